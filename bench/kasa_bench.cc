@@ -0,0 +1,450 @@
+// Benchmarks of the kasa hot paths on synthetic inputs.
+//
+// Build and run (from the repository root):
+//   g++ -std=c++17 -O2 bench/kasa_bench.cc -lbenchmark -lpthread -o kasa_bench
+//   ./kasa_bench
+//
+// Every benchmark reports its throughput in lines per second and the
+// number of heap allocations per line, counted by the replacement
+// operator new below.
+
+#define KASA_NO_MAIN
+#include "../kasa.cc"
+
+#include "kasa_synthetic.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <random>
+
+// GCC does not recognize the replaced operator new below as the
+// counterpart of free() in the replaced operator delete.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Number of heap allocations made so far.
+std::atomic<size_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = malloc(size != 0 ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+// Over-aligned allocations, made by simd_allocator and std::pmr.
+void* operator new(size_t size, std::align_val_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t align = static_cast<size_t>(alignment);
+    if (void* ptr = aligned_alloc(align, (size + align - 1) / align * align + (size == 0) * align))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+//Measurement part
+
+// Counts the allocations made while a benchmark is timed.
+struct allocation_meter {
+    size_t total = 0;
+    size_t start = allocations.load();
+
+    void pause(benchmark::State& state) {
+        total += allocations.load() - start;
+        state.PauseTiming();
+    }
+
+    void resume(benchmark::State& state) {
+        state.ResumeTiming();
+        start = allocations.load();
+    }
+};
+
+/**
+ *  Reports the throughput and allocations of a benchmark that
+ *  processed 'lines' lines per iteration.
+ */
+void report_lines(benchmark::State& state, allocation_meter& meter, size_t lines) {
+    meter.total += allocations.load() - meter.start;
+
+    double processed = (double)state.iterations() * lines;
+    state.SetItemsProcessed(state.iterations() * lines);
+    state.counters["lines/s"] = benchmark::Counter(processed, benchmark::Counter::kIsRate);
+    state.counters["allocs/line"] = meter.total / processed;
+}
+
+//Benchmarks part
+
+// Args: number of stops on the route.
+void BM_lex_new_route(benchmark::State& state) {
+    std::mt19937 rng(1);
+    synthetic_network network = make_network(256, state.range(0), rng);
+    line_tokens tokens;
+    allocation_meter meter;
+
+    // Distinct lines keep the branches on the times from being learnt.
+    for (auto _ : state)
+        for (auto& line : network.lines)
+            benchmark::DoNotOptimize(lex_new_route(line, tokens));
+
+    report_lines(state, meter, network.lines.size());
+}
+BENCHMARK(BM_lex_new_route)->Arg(4)->Arg(32)->Arg(128);
+
+// Args: number of hops of the trip.
+void BM_lex_plan_tickets(benchmark::State& state) {
+    std::mt19937 rng(2);
+    synthetic_network network = make_network(200, 20, rng);
+    std::vector<std::string> queries = make_queries(network, 256, state.range(0), rng);
+    line_tokens tokens;
+    allocation_meter meter;
+
+    for (auto _ : state)
+        for (auto& query : queries)
+            benchmark::DoNotOptimize(lex_plan_tickets(query, tokens));
+
+    report_lines(state, meter, queries.size());
+}
+BENCHMARK(BM_lex_plan_tickets)->Arg(1)->Arg(3)->Arg(8);
+
+// Args: number of routes, number of stops on each route.
+void BM_parse_and_run_new_route(benchmark::State& state) {
+    std::mt19937 rng(3);
+    synthetic_network network = make_network(state.range(0), state.range(1), rng);
+    line_tokens tokens;
+    allocation_meter meter;
+
+    for (auto _ : state) {
+        meter.pause(state);
+        routes_data r_data;
+        meter.resume(state);
+
+        for (auto& line : network.lines) {
+            lex_new_route(line, tokens);
+            benchmark::DoNotOptimize(parse_and_run_new_route(r_data, tokens));
+        }
+
+        meter.pause(state);
+        r_data = routes_data();
+        meter.resume(state);
+    }
+
+    report_lines(state, meter, network.lines.size());
+}
+BENCHMARK(BM_parse_and_run_new_route)->Args({100, 10})->Args({1000, 30})->Args({5000, 50});
+
+// Args: number of routes, stops per route, threads.
+void BM_stage_new_routes(benchmark::State& state) {
+    std::mt19937 rng(3);
+    synthetic_network network = make_network(state.range(0), state.range(1), rng);
+    line_tokens tokens;
+    allocation_meter meter;
+
+    for (auto _ : state) {
+        meter.pause(state);
+        routes_data r_data;
+        route_batch staged;
+        staged.threads = state.range(2);
+        meter.resume(state);
+
+        for (auto& line : network.lines) {
+            lex_new_route(line, tokens);
+            benchmark::DoNotOptimize(parse_and_run_new_route(r_data, tokens, &staged));
+        }
+        flush_route_batch(r_data.schedule, staged);
+
+        meter.pause(state);
+        r_data = routes_data();
+        meter.resume(state);
+    }
+
+    report_lines(state, meter, network.lines.size());
+}
+BENCHMARK(BM_stage_new_routes)->Args({100, 10, 1})->Args({1000, 30, 1})->Args({5000, 50, 1})
+    ->Args({5000, 50, 4})->UseRealTime();
+
+// Args: number of tickets.
+void BM_add_new_ticket(benchmark::State& state) {
+    std::mt19937 rng(4);
+    std::vector<std::string> tariff = make_tariff(state.range(0), rng);
+    line_tokens tokens;
+    allocation_meter meter;
+
+    for (auto _ : state) {
+        meter.pause(state);
+        tickets_data t_data;
+        initialize_optimal_ticket_set(t_data);
+        meter.resume(state);
+
+        for (auto& line : tariff) {
+            lex_new_ticket(line, tokens);
+            benchmark::DoNotOptimize(parse_and_run_new_ticket(t_data, tokens));
+        }
+
+        meter.pause(state);
+        t_data = tickets_data();
+        meter.resume(state);
+    }
+
+    report_lines(state, meter, tariff.size());
+}
+BENCHMARK(BM_add_new_ticket)->Arg(10)->Arg(1000)->Arg(10000);
+
+// Args: number of tickets.
+void BM_optimal_ticket_set(benchmark::State& state) {
+    std::mt19937 rng(5);
+    tickets_data t_data;
+    initialize_optimal_ticket_set(t_data);
+
+    line_tokens tokens;
+    for (auto& line : make_tariff(state.range(0), rng)) {
+        lex_new_ticket(line, tokens);
+        parse_and_run_new_ticket(t_data, tokens);
+    }
+
+    allocation_meter meter;
+    for (auto _ : state)
+        for (int length = 1; length <= MAX_TRIP_LENGTH; length++)
+            benchmark::DoNotOptimize(optimal_ticket_set(t_data, length));
+
+    report_lines(state, meter, MAX_TRIP_LENGTH);
+}
+BENCHMARK(BM_optimal_ticket_set)->Arg(10)->Arg(1000);
+
+// Args: number of tickets, number of threads.
+void BM_optimal_ticket_sets(benchmark::State& state) {
+    std::mt19937 rng(5);
+    tickets_data t_data;
+    initialize_optimal_ticket_set(t_data);
+
+    line_tokens tokens;
+    for (auto& line : make_tariff(state.range(0), rng)) {
+        lex_new_ticket(line, tokens);
+        parse_and_run_new_ticket(t_data, tokens);
+    }
+
+    std::vector<int> lengths(1 << 20);
+    for (auto& length : lengths)
+        length = 1 + rng() % MAX_TRIP_LENGTH;
+    std::vector<int> prices(lengths.size());
+    std::vector<int> ids(lengths.size() * t_data.max_tickets());
+
+    allocation_meter meter;
+    for (auto _ : state) {
+        optimal_ticket_sets(t_data, lengths.data(), lengths.size(), prices.data(), ids.data(),
+                            state.range(1));
+        benchmark::DoNotOptimize(ids.data());
+    }
+
+    report_lines(state, meter, lengths.size());
+}
+BENCHMARK(BM_optimal_ticket_sets)->Args({10, 1})->Args({1000, 1})->Args({1000, 4})->UseRealTime();
+
+// A tariff change between trip requests: a few tickets are added
+// to a loaded tariff and the replies are rendered again after each one.
+// Args: number of tickets loaded first.
+void BM_add_ticket_rendered(benchmark::State& state) {
+    const int added = 64;
+    std::mt19937 rng(5);
+    std::vector<std::string> tariff = make_tariff(state.range(0) + added, rng);
+    tickets_data loaded;
+    initialize_optimal_ticket_set(loaded);
+
+    line_tokens tokens;
+    for (int i = 0; i < state.range(0); i++) {
+        lex_new_ticket(tariff[i], tokens);
+        parse_and_run_new_ticket(loaded, tokens);
+    }
+    render_ticket_set_replies(loaded);
+
+    allocation_meter meter;
+    for (auto _ : state) {
+        meter.pause(state);
+        tickets_data t_data = loaded;
+        meter.resume(state);
+
+        for (size_t i = state.range(0); i < tariff.size(); i++) {
+            lex_new_ticket(tariff[i], tokens);
+            parse_and_run_new_ticket(t_data, tokens);
+            render_ticket_set_replies(t_data);
+        }
+
+        meter.pause(state);
+        t_data = tickets_data();
+        meter.resume(state);
+    }
+
+    report_lines(state, meter, added);
+}
+BENCHMARK(BM_add_ticket_rendered)->Arg(10)->Arg(1000);
+
+// Fare changes: tickets of a loaded tariff are repriced one by one.
+// Args: number of tickets.
+void BM_update_ticket(benchmark::State& state) {
+    std::mt19937 rng(5);
+    tickets_data t_data;
+    initialize_optimal_ticket_set(t_data);
+
+    line_tokens tokens;
+    for (auto& line : make_tariff(state.range(0), rng)) {
+        lex_new_ticket(line, tokens);
+        parse_and_run_new_ticket(t_data, tokens);
+    }
+
+    // The same names with other prices and expiration times.
+    std::vector<std::string> updates = make_tariff(state.range(0), rng);
+    for (auto& line : updates)
+        line = "= " + line;
+
+    allocation_meter meter;
+    for (auto _ : state)
+        for (auto& line : updates) {
+            lex_update_ticket(line, tokens);
+            benchmark::DoNotOptimize(parse_and_run_update_ticket(t_data, tokens));
+        }
+
+    report_lines(state, meter, updates.size());
+}
+BENCHMARK(BM_update_ticket)->Arg(10)->Arg(1000);
+
+// Fare changes of the cheapest ticket for the longest trips a single
+// ticket lasts for. It is never dominated, so every change recomputes
+// the table.
+// Args: number of tickets.
+void BM_update_best_ticket(benchmark::State& state) {
+    std::mt19937 rng(5);
+    tickets_data t_data;
+    initialize_optimal_ticket_set(t_data);
+
+    line_tokens tokens;
+    for (auto& line : make_tariff(state.range(0), rng)) {
+        lex_new_ticket(line, tokens);
+        parse_and_run_new_ticket(t_data, tokens);
+    }
+
+    // Lowers the price by a cent and raises it back.
+    int length = t_data.max_length();
+    while (t_data.ticket(0)[length] < 0)
+        length--;
+    int id = t_data.ticket(0)[length];
+    const ticket_info& ticket = t_data.tickets[id];
+    std::string updates[2];
+    for (int i = 0; i < 2; i++) {
+        int price = t_data.ticket_prices[id].value - 1 + i;
+        char fraction[3];
+        snprintf(fraction, sizeof(fraction), "%02d", price % 100);
+        updates[i] = "= " + ticket.first + " " + std::to_string(price / 100) + "." + fraction +
+                     " " + std::to_string(ticket.second);
+    }
+
+    allocation_meter meter;
+    for (auto _ : state)
+        for (auto& line : updates) {
+            lex_update_ticket(line, tokens);
+            benchmark::DoNotOptimize(parse_and_run_update_ticket(t_data, tokens));
+        }
+
+    report_lines(state, meter, 2);
+}
+BENCHMARK(BM_update_best_ticket)->Arg(10)->Arg(1000)->Arg(10000);
+
+// Args: number of routes, number of hops of the trips.
+void BM_check_trip_validity(benchmark::State& state) {
+    std::mt19937 rng(6);
+    synthetic_network network = make_network(state.range(0), 30, rng);
+    routes_data r_data;
+    line_tokens tokens;
+
+    for (auto& line : network.lines) {
+        lex_new_route(line, tokens);
+        parse_and_run_new_route(r_data, tokens);
+    }
+
+    // Resolves the trips to stop identifiers up front.
+    std::vector<std::pair<std::vector<stop_id>, std::vector<int> > > trips;
+    for (auto& query : make_queries(network, 1024, state.range(1), rng)) {
+        lex_plan_tickets(query, tokens);
+        std::vector<stop_id> stops;
+        for (auto& stop : tokens.stops)
+            stops.push_back(find_stop(r_data.stops, stop));
+        trips.push_back(std::make_pair(stops, tokens.routes));
+    }
+
+    allocation_meter meter;
+    for (auto _ : state)
+        for (auto& trip : trips)
+            benchmark::DoNotOptimize(check_trip_validity(trip.first, trip.second, r_data.schedule));
+
+    report_lines(state, meter, trips.size());
+}
+BENCHMARK(BM_check_trip_validity)->Args({100, 1})->Args({1000, 3})->Args({1000, 8});
+
+// Args: number of routes, number of tickets, number of queries.
+void BM_process_input(benchmark::State& state) {
+    std::mt19937 rng(7);
+    synthetic_network network = make_network(state.range(0), 20, rng);
+    std::vector<std::string> tariff = make_tariff(state.range(1), rng);
+    std::vector<std::string> queries = make_queries(network, state.range(2), 3, rng);
+
+    // The input goes through a temporary file, as the program reads it.
+    FILE* file = tmpfile();
+    for (auto* lines : {&network.lines, &tariff, &queries})
+        for (auto& line : *lines)
+            fprintf(file, "%s\n", line.c_str());
+    fflush(file);
+
+    size_t lines = network.lines.size() + tariff.size() + queries.size();
+    int null_fd = open("/dev/null", O_WRONLY);
+    allocation_meter meter;
+
+    for (auto _ : state) {
+        meter.pause(state);
+        routes_data r_data;
+        tickets_data t_data;
+        initialize_optimal_ticket_set(t_data);
+
+        output_streams outputs;
+        open_outputs(outputs, OUTPUT_BUFFER_SIZE);
+        outputs.out.fd = outputs.err.fd = null_fd;
+
+        input_reader input;
+        open_input(input, fileno(file));
+        meter.resume(state);
+
+        benchmark::DoNotOptimize(process_input(input, r_data, t_data, outputs));
+
+        meter.pause(state);
+        close_input(input);
+        r_data = routes_data();
+        t_data = tickets_data();
+        outputs = output_streams();
+        meter.resume(state);
+    }
+
+    report_lines(state, meter, lines);
+    close(null_fd);
+    fclose(file);
+}
+BENCHMARK(BM_process_input)->Args({100, 10, 10000})->Args({2000, 200, 200000});
+
+BENCHMARK_MAIN();
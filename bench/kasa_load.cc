@@ -0,0 +1,675 @@
+// Load generator and replay driver for kasa, to size hardware and to
+// compare builds against each other under the same load.
+//
+// Build (from the repository root):
+//   g++ -std=c++17 -O2 -pthread bench/kasa_load.cc -o kasa_load
+//
+// Generate an input following regexy.txt; the same options and seed
+// always give the same lines:
+//   ./kasa_load generate --routes=2000 --stops=30 --tickets=200 --queries=100000
+//       --invalid=0.01 --waiting=0.2 --unsatisfiable=0.05 --longest-ticket=60 > load.in
+//
+// Replay it against a server, at a fixed rate of lines per second
+// (or as fast as possible without --rate):
+//   ./kasa --socket=/tmp/kasa.sock < /dev/null &
+//   ./kasa_load replay --socket=/tmp/kasa.sock --rate=50000 load.in
+//
+// Every line is sent as a FRAME_LINE request and timed until its reply
+// arrives. The time is counted from the moment the line was due rather
+// than from when it was sent, so a server that cannot keep up with the
+// rate shows in the latencies instead of slowing the replay down.
+
+#define KASA_NO_MAIN
+#include "../kasa.cc"
+
+#include "kasa_synthetic.h"
+
+#include <netinet/tcp.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+//Generators part
+
+// Options of the generated input. The ratios of waiting and unsatisfiable
+// trips are of the best ticket set requests, the ratio of invalid lines
+// of all lines.
+struct load_options {
+    int routes = 1000;
+    int stops = 20;
+    int tickets = 100;
+    int queries = 10000;
+    int hops = 3;
+    int seed = 1;
+
+    // Longest validity of a ticket, and the most tickets in a set
+    // (as --max-tickets of kasa); longer trips cannot be satisfied.
+    // 0 chooses the validity: MAX_TRIP_LENGTH, or one leaving some trips
+    // unsatisfiable if they are asked for (see 'unsatisfiable_ticket_length').
+    int longest_ticket = 0;
+    int max_tickets = 3;
+
+    // Ratio of routes starting at a stop of an earlier route when it
+    // arrives there, so that trips can change routes without waiting.
+    double transfers = 0.5;
+
+    double invalid = 0;
+    double waiting = 0.1;
+    double unsatisfiable = 0;
+    double journeys = 0;
+};
+
+// Kinds of generated trip requests, by their expected reply.
+enum query_kind {
+    QUERY_TICKETS,
+    QUERY_WAITING,
+    QUERY_UNSATISFIABLE,
+    QUERY_KINDS,
+};
+
+/**
+ *  Draws true with the probability 'ratio', the same on every platform.
+ */
+bool draw(std::mt19937& rng, double ratio) {
+    return rng() < ratio * 4294967296.0;
+}
+
+/**
+ *  Generates a network like 'make_network', in which a ratio 'transfers'
+ *  of the routes start at a stop of an earlier route at the time it
+ *  arrives there. Routes running past LAST_ARRIVAL are cut short.
+ */
+synthetic_network make_connected_network(int routes, int stops, double transfers,
+                                         std::mt19937& rng) {
+    synthetic_network network;
+    int pool = std::max(2 * stops, routes * stops / 4);
+    int max_step = std::max(1, (LAST_ARRIVAL - FIRST_ARRIVAL - 60) / stops);
+
+    std::vector<int> ids(pool);
+    for (int i = 0; i < pool; i++)
+        ids[i] = i;
+
+    for (int r = 0; r < routes; r++) {
+        std::vector<std::pair<int, int> > route;
+        std::string line = std::to_string(r);
+        int time = FIRST_ARRIVAL + rng() % 60;
+
+        int first = -1;
+        if (r > 0 && draw(rng, transfers)) {
+            auto& from = network.routes[rng() % r];
+            if (from.size() >= 2) {
+                auto& stop = from[1 + rng() % (from.size() - 1)];
+                first = stop.first;
+                time = stop.second;
+            }
+        }
+
+        for (int k = 0; k < stops && time <= LAST_ARRIVAL; k++) {
+            if (k == 0 && first >= 0)
+                std::swap(ids[0], *std::find(ids.begin(), ids.end(), first));
+            else
+                std::swap(ids[k], ids[k + rng() % (pool - k)]);
+
+            route.push_back(std::make_pair(ids[k], time));
+            line += " " + time_text(time) + " " + stop_name(ids[k]);
+            time += 1 + rng() % max_step;
+        }
+
+        network.routes.push_back(route);
+        network.lines.push_back(line);
+    }
+    return network;
+}
+
+// A generated trip request and the reply it gets.
+struct generated_query {
+    std::string line;
+    query_kind kind;
+};
+
+/**
+ *  Generates a trip request of up to 'hops' routes following the network,
+ *  trying for one of the given kind: a trip that waits at its first
+ *  change of routes, or one that does not wait at all.
+ */
+generated_query make_trip(const synthetic_network& network,
+                          const std::unordered_map<int, std::vector<std::pair<int, int> > >& visits,
+                          const load_options& options, query_kind kind, std::mt19937& rng) {
+    int route, size;
+    do {
+        route = rng() % network.routes.size();
+        size = network.routes[route].size();
+    } while (size < 2);
+
+    int pos = rng() % (size - 1);
+    int departure = network.routes[route][pos].second;
+    int arrival = departure;
+    bool waited = false;
+    std::string line = "? " + stop_name(network.routes[route][pos].first);
+
+    for (int hop = 0; hop < options.hops; hop++) {
+        // Unsatisfiable trips go as far as the routes do.
+        int target = kind == QUERY_UNSATISFIABLE ? size - 1 : pos + 1 + rng() % (size - pos - 1);
+        int stop = network.routes[route][target].first;
+        arrival = network.routes[route][target].second;
+        line += " " + std::to_string(route) + " " + stop_name(stop);
+
+        // Continues with another route leaving the stop, on arrival
+        // or, for a waiting trip, later at the first change.
+        std::vector<std::pair<int, int> > next;
+        for (auto& visit : visits.at(stop)) {
+            auto& other = network.routes[visit.first];
+            if (visit.first == route || visit.second + 1 >= (int)other.size())
+                continue;
+
+            int leaves = other[visit.second].second;
+            bool wait = kind == QUERY_WAITING && hop == 0;
+            if (wait ? leaves > arrival : leaves == arrival || (waited && leaves > arrival))
+                next.push_back(visit);
+        }
+        if (hop + 1 == options.hops || next.empty())
+            break;
+
+        std::tie(route, pos) = next[rng() % next.size()];
+        size = network.routes[route].size();
+        waited |= network.routes[route][pos].second != arrival;
+    }
+
+    // Sets of tickets cover any trip up to max_tickets longest tickets.
+    query_kind reply = waited ? QUERY_WAITING
+        : arrival - departure + 1 > options.max_tickets * options.longest_ticket
+            ? QUERY_UNSATISFIABLE : QUERY_TICKETS;
+    return generated_query{line, reply};
+}
+
+/**
+ *  Generates an earliest journey request between two stops of a route,
+ *  departing up to half an hour before the route leaves the first one.
+ */
+std::string make_journey(const synthetic_network& network, std::mt19937& rng) {
+    int route, size;
+    do {
+        route = rng() % network.routes.size();
+        size = network.routes[route].size();
+    } while (size < 2);
+
+    int pos = rng() % (size - 1);
+    int target = pos + 1 + rng() % (size - pos - 1);
+    int time = std::max(FIRST_ARRIVAL, network.routes[route][pos].second - (int)(rng() % 30));
+
+    return "?@ " + stop_name(network.routes[route][pos].first) + " " + time_text(time) + " " +
+           stop_name(network.routes[route][target].first);
+}
+
+/**
+ *  Generates a line rejected with an error: a malformed line, a duplicate
+ *  of one of the first 'routes' routes or 'tickets' tickets (which were
+ *  already added), or a trip on a route that does not exist.
+ */
+std::string make_invalid_line(const std::string& valid, int routes, int tickets,
+                              const load_options& options, std::mt19937& rng) {
+    switch (rng() % 4) {
+    case 1:
+        if (routes > 0)
+            return std::to_string(rng() % routes) + " " + time_text(FIRST_ARRIVAL) + " Sa";
+        break;
+    case 2:
+        if (tickets > 0)
+            return "Ticket " + stop_name(rng() % tickets) + " 1.00 1";
+        break;
+    case 3:
+        return "? Sa " + std::to_string(options.routes + rng() % 1000) + " Sb";
+    }
+
+    // No line of the grammar contains '#'.
+    std::string line = valid;
+    line[rng() % line.size()] = '#';
+    return line;
+}
+
+/**
+ *  Chooses the longest validity of a ticket so that trips can be
+ *  unsatisfiable: sets of 'max_tickets' tickets cover half the time
+ *  a median route of the network runs.
+ */
+int unsatisfiable_ticket_length(const synthetic_network& network, int max_tickets) {
+    std::vector<int> spans;
+    for (auto& route : network.routes)
+        if (!route.empty())
+            spans.push_back(route.back().second - route.front().second + 1);
+    if (spans.empty())
+        return 1;
+
+    std::nth_element(spans.begin(), spans.begin() + spans.size() / 2, spans.end());
+    return std::max(1, spans[spans.size() / 2] / (2 * max_tickets));
+}
+
+/**
+ *  Checks whether 'count' of 'total' requests is close to the ratio
+ *  asked for: within four standard deviations of the expected count.
+ */
+bool is_near_ratio(long long count, long long total, double ratio) {
+    double expected = ratio * total;
+    return std::abs(count - expected) <= 4 * std::sqrt(expected * (1 - ratio)) + 1;
+}
+
+/**
+ *  Generates the input: the routes, the tickets, then the requests,
+ *  with invalid lines spread among them. Writes the lines to 'out'
+ *  and a summary of the replies they should get to 'err'.
+ *
+ * @return  False if the network did not allow for the ratios of waiting
+ *          and unsatisfiable trips (the input is generated anyway).
+ */
+bool generate_load(const load_options& options, std::ostream& out, std::ostream& err) {
+    std::mt19937 rng(options.seed);
+    synthetic_network network = make_connected_network(options.routes, options.stops,
+                                                       options.transfers, rng);
+    int longest_ticket = options.longest_ticket;
+    if (longest_ticket == 0)
+        longest_ticket = options.unsatisfiable > 0
+            ? unsatisfiable_ticket_length(network, options.max_tickets) : MAX_TRIP_LENGTH;
+    std::vector<std::string> tariff = make_tariff(options.tickets, rng, longest_ticket);
+
+    // The trips are classified by the longest ticket actually generated.
+    load_options trips = options;
+    trips.longest_ticket = 0;
+    for (auto& line : tariff)
+        trips.longest_ticket = std::max(trips.longest_ticket, atoi(line.c_str() + line.rfind(' ')));
+
+    std::unordered_map<int, std::vector<std::pair<int, int> > > visits;
+    for (size_t r = 0; r < network.routes.size(); r++)
+        for (size_t k = 0; k < network.routes[r].size(); k++)
+            visits[network.routes[r][k].first].push_back(std::make_pair(r, k));
+
+    long long replies[QUERY_KINDS] = {};
+    long long asked[QUERY_KINDS] = {};
+    long long journeys = 0, invalid = 0;
+    int routes = 0, tickets = 0;
+
+    auto emit = [&](const std::string& line) {
+        while (draw(rng, options.invalid)) {
+            out << make_invalid_line(line, routes, tickets, options, rng) << '\n';
+            invalid++;
+        }
+        out << line << '\n';
+    };
+
+    for (auto& line : network.lines) {
+        emit(line);
+        routes++;
+    }
+    for (auto& line : tariff) {
+        emit(line);
+        tickets++;
+    }
+
+    for (int i = 0; i < options.queries; i++) {
+        if (draw(rng, options.journeys)) {
+            emit(make_journey(network, rng));
+            journeys++;
+            continue;
+        }
+
+        query_kind kind = draw(rng, options.waiting) ? QUERY_WAITING
+            : draw(rng, options.unsatisfiable / (1 - options.waiting)) ? QUERY_UNSATISFIABLE
+            : QUERY_TICKETS;
+
+        // Not every kind may be possible in the network; the last
+        // attempt is kept then.
+        asked[kind]++;
+        generated_query query;
+        for (int attempt = 0; attempt < 100; attempt++) {
+            query = make_trip(network, visits, trips, kind, rng);
+            if (query.kind == kind)
+                break;
+        }
+        emit(query.line);
+        replies[query.kind]++;
+    }
+
+    err << "routes " << routes << "\n"
+        << "tickets " << tickets << "\n"
+        << "queries_tickets " << replies[QUERY_TICKETS] << "\n"
+        << "queries_waiting " << replies[QUERY_WAITING] << "\n"
+        << "queries_unsatisfiable " << replies[QUERY_UNSATISFIABLE] << "\n"
+        << "queries_journeys " << journeys << "\n"
+        << "invalid " << invalid << "\n";
+
+    // Kinds that are rare or impossible in the network miss their ratios.
+    long long trip_count = options.queries - journeys;
+    bool near = true;
+    for (query_kind kind : {QUERY_WAITING, QUERY_UNSATISFIABLE}) {
+        double ratio = kind == QUERY_WAITING ? options.waiting : options.unsatisfiable;
+        if (asked[kind] > 0 && !is_near_ratio(replies[kind], trip_count, ratio)) {
+            err << "Generated " << replies[kind] << " "
+                << (kind == QUERY_WAITING ? "waiting" : "unsatisfiable") << " trips of "
+                << asked[kind] << " asked for, the network does not allow for more\n";
+            near = false;
+        }
+    }
+    return near;
+}
+
+//Replay part
+
+// Kinds of replies counted by the replay, by their first bytes.
+enum reply_kind {
+    REPLY_NONE,
+    REPLY_TICKETS,
+    REPLY_WAITING,
+    REPLY_UNSATISFIABLE,
+    REPLY_ERROR,
+    REPLY_OTHER,
+    REPLY_KINDS,
+};
+
+/**
+ *  Classifies the reply to a line.
+ */
+reply_kind classify_reply(std::string_view reply) {
+    if (reply.empty())
+        return REPLY_NONE;
+    if (reply[0] == '!')
+        return REPLY_TICKETS;
+    if (reply.substr(0, 2) == ":(")
+        return REPLY_WAITING;
+    if (reply.substr(0, 2) == ":|")
+        return REPLY_UNSATISFIABLE;
+    if (reply.substr(0, 5) == "Error")
+        return REPLY_ERROR;
+    return REPLY_OTHER;
+}
+
+/**
+ *  Connects to a server listening on the Unix socket 'socket_path'
+ *  or, if it is empty, on the TCP port 'port' of the loopback interface.
+ *
+ * @return  The connected socket, or -1 on failure.
+ */
+int connect_to_server(const std::string& socket_path, int port) {
+    int fd;
+
+    if (!socket_path.empty()) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(address.sun_path, socket_path.data(), socket_path.size());
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+            return -1;
+    }
+    else {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int nodelay = 1;
+        if (fd < 0 || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0 ||
+            connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+            return -1;
+    }
+    return fd;
+}
+
+/**
+ *  Writes the whole text to the socket.
+ *
+ * @return  False on failure.
+ */
+bool send_all(int fd, std::string_view text) {
+    while (!text.empty()) {
+        ssize_t sent = write(fd, text.data(), text.size());
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        text.remove_prefix(sent);
+    }
+    return true;
+}
+
+/**
+ *  Returns the value at the 'fraction' of the sorted values.
+ */
+double percentile(const std::vector<long long>& sorted, double fraction) {
+    size_t pos = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+    return sorted[pos];
+}
+
+/**
+ *  Replays the nonempty lines of 'input' through the connected socket,
+ *  'rate' lines per second (or as fast as possible if it is 0), and
+ *  writes the latencies, the throughput and the replies to 'out'.
+ *
+ * @return  False if the connection failed.
+ */
+bool replay_load(int fd, std::string_view input, int rate, std::ostream& out) {
+    std::vector<std::string_view> lines;
+    for (size_t pos = 0; pos < input.size();) {
+        size_t end = std::min(input.find('\n', pos), input.size());
+        if (end > pos)
+            lines.push_back(input.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    if (lines.empty())
+        return true;
+
+    using clock = std::chrono::steady_clock;
+    std::vector<clock::time_point> due(lines.size());
+    std::atomic<size_t> sent{0};
+    bool send_failed = false;
+
+    clock::time_point start = clock::now();
+    if (rate > 0)
+        for (size_t i = 0; i < lines.size(); i++)
+            due[i] = start + std::chrono::nanoseconds((long long)(i * 1e9 / rate));
+
+    std::thread sender([&] {
+        std::string frames;
+        size_t next = 0;
+
+        while (next < lines.size()) {
+            // Sends at once all lines that are due.
+            clock::time_point now = clock::now();
+            size_t end = next;
+            if (rate == 0) {
+                end = std::min(lines.size(), next + 64);
+                for (size_t i = next; i < end; i++)
+                    due[i] = now;
+            }
+            else {
+                while (end < lines.size() && due[end] <= now)
+                    end++;
+                if (end == next) {
+                    std::this_thread::sleep_until(due[next]);
+                    continue;
+                }
+            }
+
+            frames.clear();
+            for (size_t i = next; i < end; i++)
+                append_frame(frames, FRAME_LINE, lines[i]);
+            sent.store(end, std::memory_order_release);
+            if (!send_all(fd, frames)) {
+                send_failed = true;
+                break;
+            }
+            next = end;
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    std::vector<long long> latencies;
+    latencies.reserve(lines.size());
+    long long replies[REPLY_KINDS] = {};
+    std::string received;
+    std::vector<char> buffer(1 << 16);
+    size_t pos = 0;
+
+    while (latencies.size() < lines.size()) {
+        ssize_t length = read(fd, buffer.data(), buffer.size());
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            break;
+        clock::time_point now = clock::now();
+        received.append(buffer.data(), length);
+
+        while (received.size() - pos >= FRAME_HEADER_SIZE) {
+            uint32_t size = 0;
+            for (int i = 0; i < 4; i++)
+                size |= (uint32_t)(unsigned char)received[pos + 2 + i] << (8 * i);
+            if (received.size() - pos - FRAME_HEADER_SIZE < size)
+                break;
+
+            size_t line = latencies.size();
+            while (sent.load(std::memory_order_acquire) <= line)
+                std::this_thread::yield();
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - due[line]).count());
+            replies[classify_reply(std::string_view(received).substr(pos + FRAME_HEADER_SIZE, size))]++;
+            pos += FRAME_HEADER_SIZE + size;
+        }
+        received.erase(0, pos);
+        pos = 0;
+    }
+    clock::time_point finish = clock::now();
+
+    sender.join();
+    if (send_failed || latencies.size() < lines.size())
+        return false;
+
+    double seconds = std::chrono::duration<double>(finish - start).count();
+    std::sort(latencies.begin(), latencies.end());
+
+    out << "lines " << lines.size() << "\n"
+        << "seconds " << seconds << "\n"
+        << "lines_per_second " << lines.size() / seconds << "\n"
+        << "latency_p50_us " << percentile(latencies, 0.5) / 1000 << "\n"
+        << "latency_p99_us " << percentile(latencies, 0.99) / 1000 << "\n"
+        << "latency_p999_us " << percentile(latencies, 0.999) / 1000 << "\n"
+        << "latency_max_us " << latencies.back() / 1000.0 << "\n"
+        << "replies_none " << replies[REPLY_NONE] << "\n"
+        << "replies_tickets " << replies[REPLY_TICKETS] << "\n"
+        << "replies_waiting " << replies[REPLY_WAITING] << "\n"
+        << "replies_unsatisfiable " << replies[REPLY_UNSATISFIABLE] << "\n"
+        << "replies_errors " << replies[REPLY_ERROR] << "\n"
+        << "replies_other " << replies[REPLY_OTHER] << "\n";
+    return true;
+}
+
+//Main function part
+
+/**
+ *  Reads the value of the command line option 'name', given as
+ *  "name=value", of a ratio between 0 and 1.
+ *
+ * @return  False if the argument is not the option.
+ *          Exits the program if the value is invalid.
+ */
+bool read_ratio_option(std::string_view arg, std::string_view name, double& value) {
+    std::string text;
+    if (!read_text_option(arg, name, text))
+        return false;
+
+    char* end;
+    value = strtod(text.c_str(), &end);
+    if (*end != '\0' || !(value >= 0 && value < 1)) {
+        std::cerr << "Invalid value of " << name << "\n";
+        exit(1);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::string_view mode = argc > 1 ? argv[1] : "";
+    load_options options;
+    std::string socket_path, input_path;
+    int port = 0, rate = 0;
+
+    for (int i = 2; i < argc; i++) {
+        std::string_view arg = argv[i];
+
+        if (mode == "generate") {
+            if (read_option(arg, "--routes", options.routes) ||
+                read_option(arg, "--stops", options.stops) ||
+                read_option(arg, "--tickets", options.tickets) ||
+                read_option(arg, "--queries", options.queries) ||
+                read_option(arg, "--hops", options.hops) ||
+                read_option(arg, "--seed", options.seed) ||
+                read_option(arg, "--longest-ticket", options.longest_ticket) ||
+                read_option(arg, "--max-tickets", options.max_tickets) ||
+                read_ratio_option(arg, "--transfers", options.transfers) ||
+                read_ratio_option(arg, "--invalid", options.invalid) ||
+                read_ratio_option(arg, "--waiting", options.waiting) ||
+                read_ratio_option(arg, "--unsatisfiable", options.unsatisfiable) ||
+                read_ratio_option(arg, "--journeys", options.journeys))
+                continue;
+        }
+        else if (mode == "replay") {
+            if (read_text_option(arg, "--socket", socket_path) ||
+                read_option(arg, "--port", port) ||
+                read_option(arg, "--rate", rate))
+                continue;
+            if (input_path.empty() && arg.substr(0, 2) != "--") {
+                input_path = arg;
+                continue;
+            }
+        }
+
+        std::cerr << "Unknown option " << arg << "\n";
+        return 1;
+    }
+
+    if (mode == "generate") {
+        if (options.waiting + options.unsatisfiable >= 1 ||
+            options.longest_ticket > MAX_TRIP_LENGTH) {
+            std::cerr << "Invalid ratios of queries or --longest-ticket\n";
+            return 1;
+        }
+        return generate_load(options, std::cout, std::cerr) ? 0 : 1;
+    }
+
+    if (mode != "replay") {
+        std::cerr << "Usage: " << argv[0] << " generate [options] > input\n"
+                  << "       " << argv[0] << " replay (--socket=path | --port=n) [--rate=n] input\n";
+        return 1;
+    }
+
+    if (input_path.empty() || (socket_path.empty() && port == 0)) {
+        std::cerr << "Replay needs an input and --socket or --port\n";
+        return 1;
+    }
+
+    std::ifstream file(input_path, std::ios::binary);
+    std::stringstream contents;
+    if (!(contents << file.rdbuf())) {
+        std::cerr << "Cannot read " << input_path << "\n";
+        return 1;
+    }
+    std::string input = contents.str();
+
+    int fd = connect_to_server(socket_path, port);
+    if (fd < 0) {
+        std::cerr << "Cannot connect to the server: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    bool replayed = replay_load(fd, input, rate, std::cout);
+    close(fd);
+    if (!replayed) {
+        std::cerr << "The connection to the server failed\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Generators of synthetic kasa inputs, shared by the benchmarks and
+// the load generator. Included after kasa.cc (built with KASA_NO_MAIN).
+
+#ifndef KASA_SYNTHETIC_H
+#define KASA_SYNTHETIC_H
+
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//Generators part
+
+// A synthetic bus network: for every route the pairs <stop, arrival_time>,
+// and the lines describing it.
+struct synthetic_network {
+    std::vector<std::vector<std::pair<int, int> > > routes;
+    std::vector<std::string> lines;
+};
+
+/**
+ *  Generates a stop name made of letters only, unique for the id.
+ */
+std::string stop_name(int id) {
+    std::string name = "S";
+    do {
+        name += 'a' + id % 26;
+        id /= 26;
+    } while (id > 0);
+    return name;
+}
+
+/**
+ *  Renders minutes since midnight in the H:MM format.
+ */
+std::string time_text(int minutes) {
+    std::string out = std::to_string(minutes / 60) + ":";
+    out += '0' + minutes % 60 / 10;
+    out += '0' + minutes % 10;
+    return out;
+}
+
+/**
+ *  Generates a network of 'routes' routes with 'stops' stops each,
+ *  sharing a pool of stops so that trips can change routes.
+ */
+synthetic_network make_network(int routes, int stops, std::mt19937& rng) {
+    synthetic_network network;
+    int pool = std::max(2 * stops, routes * stops / 4);
+    int max_step = std::max(1, (LAST_ARRIVAL - FIRST_ARRIVAL - 60) / stops);
+
+    std::vector<int> ids(pool);
+    for (int i = 0; i < pool; i++)
+        ids[i] = i;
+
+    for (int r = 0; r < routes; r++) {
+        std::vector<std::pair<int, int> > route;
+        std::string line = std::to_string(r);
+        int time = FIRST_ARRIVAL + rng() % 60;
+
+        for (int k = 0; k < stops; k++) {
+            std::swap(ids[k], ids[k + rng() % (pool - k)]);
+            route.push_back(std::make_pair(ids[k], time));
+            line += " " + time_text(time) + " " + stop_name(ids[k]);
+            time += 1 + rng() % max_step;
+        }
+
+        network.routes.push_back(route);
+        network.lines.push_back(line);
+    }
+    return network;
+}
+
+/**
+ *  Generates lines adding 'count' tickets with unique names,
+ *  valid for at most 'longest' minutes each.
+ */
+std::vector<std::string> make_tariff(int count, std::mt19937& rng,
+                                     int longest = MAX_TRIP_LENGTH) {
+    std::vector<std::string> lines;
+
+    for (int i = 0; i < count; i++) {
+        std::string line = "Ticket " + stop_name(i) + " ";
+        line += std::to_string(1 + rng() % 50) + "." + std::to_string(10 + rng() % 90);
+        line += " " + std::to_string(1 + rng() % longest);
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+/**
+ *  Generates 'count' trip requests of up to 'hops' routes each, following
+ *  the network so that the requests are valid (although some of them
+ *  require waiting).
+ */
+std::vector<std::string> make_queries(const synthetic_network& network, int count, int hops,
+                                      std::mt19937& rng) {
+    // For every stop, the pairs <route, position on the route>.
+    std::unordered_map<int, std::vector<std::pair<int, int> > > visits;
+    for (size_t r = 0; r < network.routes.size(); r++)
+        for (size_t k = 0; k < network.routes[r].size(); k++)
+            visits[network.routes[r][k].first].push_back(std::make_pair(r, k));
+
+    std::vector<std::string> lines;
+    while ((int)lines.size() < count) {
+        int route = rng() % network.routes.size();
+        int size = network.routes[route].size();
+        if (size < 2)
+            return lines;
+
+        int pos = rng() % (size - 1);
+        std::string line = "? " + stop_name(network.routes[route][pos].first);
+
+        for (int hop = 0; hop < hops; hop++) {
+            int target = pos + 1 + rng() % (size - pos - 1);
+            int stop = network.routes[route][target].first;
+            int time = network.routes[route][target].second;
+            line += " " + std::to_string(route) + " " + stop_name(stop);
+
+            // Continues with a route leaving the stop later, if there is one.
+            std::vector<std::pair<int, int> > next;
+            for (auto& visit : visits[stop]) {
+                auto& other = network.routes[visit.first];
+                if (visit.second + 1 < (int)other.size() && other[visit.second].second >= time)
+                    next.push_back(visit);
+            }
+            if (next.empty())
+                break;
+
+            std::tie(route, pos) = next[rng() % next.size()];
+            size = network.routes[route].size();
+        }
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+#endif
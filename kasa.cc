@@ -1,59 +1,493 @@
 
-#include <unordered_set>
+#include <unordered_map>
 #include <algorithm>
 #include <iostream>
 #include <utility>
 #include <vector>
+#include <array>
 #include <limits>
 #include <string>
-#include <regex>
+#include <string_view>
+#include <climits>
+#include <cstdint>
 #include <cmath>
-#include <map>
-#include <set>
+#include <deque>
+#include <new>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <malloc.h>
 
-//ticket information(pair<name, expiration_time>)  
-using ticket_info = std::pair<std::string, int>;
-// pair<A, B>
-// A: An array with ticket information, the ticket position is it's ID.
-// B: An array of vectors. Each of the vectors represents best possible
-// price for a given time(vector[i][k] = pair<best price for i + 1 tickets
-// and the time equals to k, id of the latest used ticket to produce the price>).
-using tickets_data = std::pair<std::vector<ticket_info >, std::vector<std::vector<std::pair<int, int> > > >;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Dense identifier of a bus stop, assigned by a stop_dictionary.
+using stop_id = uint32_t;
+
+// Identifier of a stop name that was never interned.
+const stop_id NO_STOP = UINT32_MAX;
+
+// Structure interning stop names. Names are stored once, in a deque
+// so that the views used as keys of 'ids' stay valid as it grows;
+// the position of a name in 'names' is its stop_id. A copy rebuilds
+// 'ids', so that its keys view the names of the copy.
+struct stop_dictionary {
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, stop_id> ids;
+
+    stop_dictionary() = default;
+    stop_dictionary(stop_dictionary&&) = default;
+    stop_dictionary& operator=(stop_dictionary&&) = default;
+
+    stop_dictionary(const stop_dictionary& other) : names(other.names) {
+        ids.reserve(names.size());
+        for (stop_id id = 0; id < names.size(); id++)
+            ids.emplace(names[id], id);
+    }
+
+    stop_dictionary& operator=(const stop_dictionary& other) {
+        return *this = stop_dictionary(other);
+    }
+};
+
+// Set of stops as a bitset over their identifiers, reused between
+// routes: the stops inserted while checking a route are erased
+// afterwards, so that a check takes time proportional to the route.
+struct stop_set {
+    std::vector<uint64_t> words;
+};
 
 // Structure representing information about a route as a vector
-// of pairs representing consecutive stops on the route (of type string)
+// of pairs representing consecutive stops on the route (of type stop_id)
 // with given arrival time (in minutes since midnight).
-using route_info = std::vector< std::pair<std::string, int> >;
+using route_info = std::pmr::vector< std::pair<stop_id, int> >;
 
 // Structure representing a pair <S, R> of a bus stop S
 // lying on the route R.
-using schedule_point = std::pair<std::string, int>;
+using schedule_point = std::pair<stop_id, int>;
+
+// Arrival time returned for a stop that does not lie on the route.
+const int NO_TIME = -1;
 
-// Structure mapping timestamps to schedule_points 
-// represented by pairs <bus_stop, bus_route>, containing 
-// all information about arrival times of all bus routes for every stop.
-using bus_schedule = std::map<schedule_point, int>;
+// Arrival of a route at a stop (in minutes since midnight).
+struct route_stop {
+    stop_id stop;
+    int time;
+};
 
-//TODO: doc
-using routes_data = std::pair<std::set<int>, bus_schedule>;
+// Structure representing the timetable of a single route: its stops
+// in the order of visit, and an open-addressing hash index mapping
+// a stop to its position on the route. A slot holds position + 1,
+// or 0 if it is empty; the index is kept at most half full.
+struct route_timetable {
+    std::vector<route_stop> stops;
+    std::vector<uint16_t> index;
+};
+
+// Structure containing all information about arrival times
+// of all bus routes for every stop, as one timetable per route.
+// 'route_ids' maps the number of a route to its position in 'timetables'.
+struct bus_schedule {
+    std::vector<route_timetable> timetables;
+    std::unordered_map<int, uint32_t> route_ids;
+
+    // Incremented whenever a route is added.
+    unsigned version = 0;
+};
+
+// Structure holding all information about the bus network:
+// the schedule of all routes and the stop names.
+struct routes_data {
+    bus_schedule schedule;
+    stop_dictionary stops;
+};
 
 
 // In the task the longest trip can take 927 minutes. 
 const int MAX_TRIP_LENGTH = 927;
 
-// For the purpose of 'add_new_ticket' and 'get_optimal_ticket_set'
-// function it is easier to take a small margin(at least 2) so that
-// we don't have to worry about exceeding the vector size.
-const int TICKET_SET_SIZE = 1000;
+// Bounds on the arrival times accepted by the input grammar
+// (5:55 and 21:21, in minutes since midnight). See regexy.txt.
+const int FIRST_ARRIVAL = 5 * 60 + 55;
+const int LAST_ARRIVAL = 21 * 60 + 21;
+
+// A time of day or a duration, in minutes, as kept in compact tables.
+// Times accepted by the grammar lie between FIRST_ARRIVAL and
+// LAST_ARRIVAL, so they fit in 16 bits; computations are done on int.
+using minute = uint16_t;
+
+// Value of a ticket_planner bound that is given at runtime
+// instead of at compile time.
+const int DYNAMIC_BOUND = 0;
+
+// Bounds of the ticket planner used by the program: the maximal number
+// of tickets in a set and the maximal trip length (in minutes).
+// Either can be overridden at build time, e.g. -DKASA_MAX_TICKETS=5,
+// or set to DYNAMIC_BOUND (0) to be read from the command line.
+#ifndef KASA_MAX_TICKETS
+#define KASA_MAX_TICKETS 3
+#endif
+#ifndef KASA_MAX_TRIP_LENGTH
+#define KASA_MAX_TRIP_LENGTH MAX_TRIP_LENGTH
+#endif
+
+//ticket information(pair<name, expiration_time>)  
+using ticket_info = std::pair<std::string, int>;
+
+// A price in cents. Prices are not plain ints, so that they cannot be
+// mixed up with the times they are passed along with. Prices are
+// non-negative and their sums saturate at NO_PRICE, which stands
+// for "no valid ticket set".
+struct cents {
+    int32_t value;
+};
+
+const cents NO_PRICE = {INT_MAX};
+
+inline cents operator+(cents a, cents b) {
+    uint32_t sum = (uint32_t)a.value + (uint32_t)b.value;
+    return cents{(int32_t)std::min(sum, (uint32_t)INT_MAX)};
+}
+
+inline bool operator==(cents a, cents b) { return a.value == b.value; }
+inline bool operator<(cents a, cents b) { return a.value < b.value; }
+inline bool operator<=(cents a, cents b) { return a.value <= b.value; }
+
+// Allocator aligning arrays to whole AVX2 vectors (32 bytes).
+template <typename T>
+struct simd_allocator {
+    using value_type = T;
+
+    simd_allocator() = default;
+    template <typename U> simd_allocator(const simd_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(32)));
+    }
+    void deallocate(T* ptr, size_t) {
+        ::operator delete(ptr, std::align_val_t(32));
+    }
+
+    template <typename U> bool operator==(const simd_allocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const simd_allocator<U>&) const { return false; }
+};
+
+using simd_array = std::vector<int, simd_allocator<int> >;
+
+// Replies to trip requests (as written by 'plan_tickets') for trips of
+// every length, rendered lazily. The cache is dropped as a whole once
+// the version of the ticket data it was built for becomes outdated.
+struct ticket_reply_cache {
+    unsigned version = 0;
+
+    // replies[k] is the reply for a trip of length k, or an empty
+    // string if it was not rendered yet; ticket_counts[k] is the number
+    // of tickets it sells.
+    std::vector<std::string> replies;
+    std::vector<int> ticket_counts;
+};
+
+/**
+ * Ticket data for sets of at most MAX_TICKETS tickets lasting for trips
+ * of at most MAX_LENGTH minutes. A bound equal to DYNAMIC_BOUND is given
+ * to 'initialize_optimal_ticket_set' instead. Bounds fixed at compile time
+ * make the table sizes constexpr, so the loops over them can be unrolled.
+ *
+ * The table of best prices consists of one layer per number of tickets,
+ * with prices and ticket ids kept in separate arrays so that updates
+ * can be vectorized. For layer i and the time equal to k, price(i)[k] is
+ * the best price for i + 1 tickets and ticket(i)[k] is the id of
+ * the latest used ticket to produce the price.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+struct ticket_planner {
+    // An array with ticket information, the ticket position is it's ID.
+    // A removed ticket keeps its ID, with the expiration time 0.
+    std::vector<ticket_info> tickets;
+
+    // Prices of the tickets, by ID.
+    std::vector<cents> ticket_prices;
+
+    // Buckets of the tickets by their expiration times, used to update
+    // the table after a ticket changes (see 'change_ticket'). A bucket is
+    // a list linked through 'bucket_next' (by ID, -1 ends it) that starts
+    // at bucket_first[time] with its cheapest ticket (the oldest
+    // of the cheapest ones); -1 for an empty bucket.
+    std::vector<int> bucket_first;
+    std::vector<int> bucket_next;
+
+    // Open-addressing hash index of the ticket names: a slot holds
+    // the ID of a ticket + 1, or 0 if it is empty. It is kept at most
+    // half full, see 'index_ticket'.
+    std::vector<uint32_t> name_index;
+
+    // Layers of the table, one after another.
+    simd_array prices;
+    simd_array ids;
+
+    // Bounds given at runtime, used only for the DYNAMIC_BOUND ones.
+    int tickets_limit = MAX_TICKETS;
+    int length_limit = MAX_LENGTH;
+
+    // Incremented whenever the table of best prices changes.
+    unsigned version = 0;
+
+    // Replies derived from the table; filling them in does not change
+    // the ticket data itself, hence 'mutable'.
+    mutable ticket_reply_cache reply_cache;
+
+    constexpr int max_tickets() const {
+        return MAX_TICKETS != DYNAMIC_BOUND ? MAX_TICKETS : tickets_limit;
+    }
+
+    constexpr int max_length() const {
+        return MAX_LENGTH != DYNAMIC_BOUND ? MAX_LENGTH : length_limit;
+    }
+
+    // Length of a layer: times from 0 to max_length(), rounded up
+    // to whole SIMD vectors so that every layer stays aligned.
+    constexpr int stride() const {
+        return (max_length() + 8) / 8 * 8;
+    }
+
+    int* price(int layer) { return prices.data() + layer * stride(); }
+    int* ticket(int layer) { return ids.data() + layer * stride(); }
+    const int* price(int layer) const { return prices.data() + layer * stride(); }
+    const int* ticket(int layer) const { return ids.data() + layer * stride(); }
+};
+
+// The ticket data used by the program.
+using tickets_data = ticket_planner<KASA_MAX_TICKETS, KASA_MAX_TRIP_LENGTH>;
+
+//Stats part
+
+// Instrumentation of the processing: counters of events and latency
+// histograms of the stages of processing a line. It is compiled in
+// with -DKASA_STATS=1 and dumped with the --stats option.
+#ifndef KASA_STATS
+#define KASA_STATS 0
+#endif
+
+// One in this many lines has the latencies of its stages measured.
+const unsigned STATS_SAMPLE_PERIOD = 16;
+
+// Counted events.
+enum stats_counter {
+    LINES_ROUTE,
+    LINES_TICKET,
+    LINES_QUERY,
+    REJECT_SYNTAX,
+    REJECT_DUPLICATE_ROUTE,
+    REJECT_INVALID_ROUTE,
+    REJECT_DUPLICATE_TICKET,
+    REJECT_UNKNOWN_TICKET,
+    REJECT_INVALID_TRIP,
+    TRIP_CACHE_HITS,
+    TRIP_CACHE_MISSES,
+    REPLIES_RENDERED,
+    TICKETS_DOMINATED,
+    COUNTER_COUNT
+};
+
+const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "lines_route", "lines_ticket", "lines_query",
+    "reject_syntax", "reject_duplicate_route", "reject_invalid_route",
+    "reject_duplicate_ticket", "reject_unknown_ticket", "reject_invalid_trip",
+    "trip_cache_hits", "trip_cache_misses", "replies_rendered",
+    "tickets_dominated",
+};
+
+// Measured stages: a whole line, adding a route, changing
+// the tickets and planning a trip.
+enum stats_stage {
+    STAGE_LINE,
+    STAGE_ROUTE,
+    STAGE_TICKETS,
+    STAGE_PLAN,
+    STAGE_COUNT
+};
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {"line", "route", "tickets", "plan"};
+
+// Number of bits of a value below its highest set bit that select
+// a bucket of a latency_histogram, giving about 6% precision.
+const int HISTOGRAM_PRECISION = 4;
+const int HISTOGRAM_SIZE = (64 - HISTOGRAM_PRECISION + 1) << HISTOGRAM_PRECISION;
+
+// Histogram of latencies (in nanoseconds) with logarithmic buckets,
+// each power of two split into 2^HISTOGRAM_PRECISION linear ones.
+struct latency_histogram {
+    uint64_t counts[HISTOGRAM_SIZE] = {};
+    uint64_t samples = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+// Statistics gathered by a single thread.
+struct thread_stats {
+    uint64_t counters[COUNTER_COUNT] = {};
+    latency_histogram stages[STAGE_COUNT];
 
-const std::string NEW_ROUTE_REGEX = "[0-9]+( (5:5[5-9]|([6-9]|1[0-9]|20):[0-5][0-9]|21:([0-1][0-9]|2[0-1])) [_\\^A-Za-z]+)*";
-const std::string NEW_TICKET_REGEX = "[ A-Za-z]* [1-9][0-9]*\\.[0-9]{2} [1-9][0-9]*";
-const std::string BEST_TICKET_SET_REGEX = "\\?( [_\\^A-Za-z]+ [0-9]+)+ [_\\^A-Za-z]+";
+    // Whether the current line is measured.
+    unsigned sample_clock = 0;
+    bool sampling = false;
+};
 
-const std::regex NUMBER_REGEX("[0-9]+");
-const std::regex STOP_NAME_REGEX("[a-zA-Z\\^\\_]+");
-const std::regex TICKET_NAME("[ a-zA-Z]+[0-9]?");
+/**
+ *  Obtains the bucket of a latency_histogram holding the value.
+ */
+int histogram_bucket(uint64_t value) {
+    if (value < (1u << HISTOGRAM_PRECISION))
+        return value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    return ((exponent - HISTOGRAM_PRECISION + 1) << HISTOGRAM_PRECISION) +
+           ((value >> (exponent - HISTOGRAM_PRECISION)) & ((1u << HISTOGRAM_PRECISION) - 1));
+}
+
+/**
+ *  Obtains the smallest value held in the bucket of a latency_histogram.
+ */
+uint64_t histogram_bucket_value(int bucket) {
+    if (bucket < (1 << HISTOGRAM_PRECISION))
+        return bucket;
+
+    int exponent = (bucket >> HISTOGRAM_PRECISION) + HISTOGRAM_PRECISION - 1;
+    uint64_t mantissa = (1u << HISTOGRAM_PRECISION) + (bucket & ((1u << HISTOGRAM_PRECISION) - 1));
+    return mantissa << (exponent - HISTOGRAM_PRECISION);
+}
+
+/**
+ *  Obtains the value below which the fraction 'quantile' of values lie.
+ */
+uint64_t histogram_quantile(const latency_histogram& histogram, double quantile) {
+    uint64_t rank = std::ceil(quantile * histogram.samples);
+    uint64_t seen = 0;
+
+    for (int bucket = 0; bucket < HISTOGRAM_SIZE; bucket++) {
+        seen += histogram.counts[bucket];
+        if (seen >= rank && seen > 0)
+            return std::min(histogram_bucket_value(bucket), histogram.max);
+    }
+    return 0;
+}
+
+/**
+ *  Adds the statistics of 'from' to 'to'.
+ */
+void merge_stats(thread_stats& to, const thread_stats& from) {
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        to.counters[i] += from.counters[i];
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        for (int bucket = 0; bucket < HISTOGRAM_SIZE; bucket++)
+            to.stages[i].counts[bucket] += from.stages[i].counts[bucket];
+        to.stages[i].samples += from.stages[i].samples;
+        to.stages[i].sum += from.stages[i].sum;
+        to.stages[i].max = std::max(to.stages[i].max, from.stages[i].max);
+    }
+}
+
+// Statistics of the threads that already finished.
+struct stats_registry {
+    std::mutex mutex;
+    thread_stats finished;
+};
+
+stats_registry& global_stats() {
+    static stats_registry registry;
+    return registry;
+}
+
+// Statistics of the current thread, added to the registry when it finishes.
+struct local_stats_holder {
+    thread_stats stats;
+
+    ~local_stats_holder() {
+        stats_registry& registry = global_stats();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        merge_stats(registry.finished, stats);
+    }
+};
+
+inline thread_stats& local_stats() {
+    thread_local local_stats_holder holder;
+    return holder.stats;
+}
+
+/**
+ *  Obtains the statistics of the finished threads and the current one.
+ */
+thread_stats collect_stats() {
+    stats_registry& registry = global_stats();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    thread_stats total = registry.finished;
+    merge_stats(total, local_stats());
+    return total;
+}
+
+// Counts an event, if the statistics are compiled in.
+#if KASA_STATS
+#define KASA_COUNT(counter) (local_stats().counters[counter]++)
+#define KASA_SAMPLE_LINE() \
+    (local_stats().sampling = ++local_stats().sample_clock % STATS_SAMPLE_PERIOD == 0)
+#else
+#define KASA_COUNT(counter) ((void)0)
+#define KASA_SAMPLE_LINE() ((void)0)
+#endif
+
+// Measures the latency of a stage from its construction to its destruction,
+// if the statistics are compiled in and the line is sampled (or 'always').
+struct stage_timer {
+#if KASA_STATS
+    stats_stage stage;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+
+    explicit stage_timer(stats_stage stage)
+        : stage(stage), active(local_stats().sampling) {
+        if (active)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~stage_timer() {
+        if (!active)
+            return;
+
+        uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        latency_histogram& histogram = local_stats().stages[stage];
+        histogram.counts[histogram_bucket(latency)]++;
+        histogram.samples++;
+        histogram.sum += latency;
+        histogram.max = std::max(histogram.max, latency);
+    }
+#else
+    explicit stage_timer(stats_stage) {}
+#endif
+};
 
 // ticket part
 
@@ -62,574 +496,4585 @@ const std::regex TICKET_NAME("[ a-zA-Z]+[0-9]?");
  *  functions. 
  * 
  * @param t_data            The ticket data that will be initialized.
+ * @param max_tickets       The maximal number of tickets in a set,
+ *                          used if it is not fixed at compile time.
+ * @param max_length        The maximal trip length (in minutes),
+ *                          used if it is not fixed at compile time.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void initialize_optimal_ticket_set(ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data,
+                                   int max_tickets = MAX_TICKETS,
+                                   int max_length = MAX_LENGTH) {
+    t_data.tickets_limit = max_tickets;
+    t_data.length_limit = max_length;
+    t_data.version++;
+
+    t_data.prices.assign(t_data.max_tickets() * t_data.stride(), INT_MAX);
+    t_data.ids.assign(t_data.max_tickets() * t_data.stride(), -1);
+    t_data.bucket_first.assign(t_data.max_length() + 1, -1);
+
+    for (int i = 0; i < t_data.max_tickets(); i++)
+        t_data.price(i)[0] = 0;
+}
+
+/**
+ *  Adds two prices (in cents) held in the table of best prices,
+ *  like the sum of 'cents'.
  */
-void initialize_optimal_ticket_set(tickets_data& t_data) {
-    std::pair<int, int> default_pair = std::make_pair(INT_MAX, -1);
+inline int saturating_add(int a, int b) {
+    return (cents{a} + cents{b}).value;
+}
+
+/**
+ *  Min-plus update of a ticket layer with a new ticket. For every
+ *  k in [begin, end) sets the layer at k to the ticket 'id' and the price
+ *  'price + previous_price[k - shift]', if the latter is lower.
+ *
+ * @return  False if the layer did not change.
+ *
+ * @note    Uses AVX2 or NEON when available, with a scalar fallback.
+ */
+bool relax_layer(int* layer_price, int* layer_ticket, const int* previous_price,
+                 int price, int id, int shift, int begin, int end) {
+    int k = begin;
+    bool changed = false;
+
+#if defined(__AVX2__)
+    const __m256i prices = _mm256_set1_epi32(price);
+    const __m256i ids = _mm256_set1_epi32(id);
+    const __m256i limit = _mm256_set1_epi32(INT_MAX);
+    __m256i changes = _mm256_setzero_si256();
+
+    for (; k + 8 <= end; k += 8) {
+        __m256i prev = _mm256_loadu_si256((const __m256i*)(previous_price + k - shift));
+        __m256i cand = _mm256_min_epu32(_mm256_add_epi32(prev, prices), limit);
+        __m256i cur = _mm256_loadu_si256((const __m256i*)(layer_price + k));
+        __m256i better = _mm256_cmpgt_epi32(cur, cand);
+        __m256i cur_ids = _mm256_loadu_si256((const __m256i*)(layer_ticket + k));
 
-    t_data.second.resize(3);
+        _mm256_storeu_si256((__m256i*)(layer_price + k), _mm256_blendv_epi8(cur, cand, better));
+        _mm256_storeu_si256((__m256i*)(layer_ticket + k), _mm256_blendv_epi8(cur_ids, ids, better));
+        changes = _mm256_or_si256(changes, better);
+    }
+    changed = !_mm256_testz_si256(changes, changes);
+#elif defined(__ARM_NEON)
+    const uint32x4_t prices = vdupq_n_u32(price);
+    const int32x4_t ids = vdupq_n_s32(id);
+    const uint32x4_t limit = vdupq_n_u32(INT_MAX);
+    uint32x4_t changes = vdupq_n_u32(0);
+
+    for (; k + 4 <= end; k += 4) {
+        uint32x4_t prev = vld1q_u32((const uint32_t*)(previous_price + k - shift));
+        int32x4_t cand = vreinterpretq_s32_u32(vminq_u32(vaddq_u32(prev, prices), limit));
+        int32x4_t cur = vld1q_s32(layer_price + k);
+        uint32x4_t better = vcgtq_s32(cur, cand);
+
+        vst1q_s32(layer_price + k, vbslq_s32(better, cand, cur));
+        vst1q_s32(layer_ticket + k, vbslq_s32(better, ids, vld1q_s32(layer_ticket + k)));
+        changes = vorrq_u32(changes, better);
+    }
+    uint32x2_t halves = vorr_u32(vget_low_u32(changes), vget_high_u32(changes));
+    changed = vget_lane_u64(vreinterpret_u64_u32(halves), 0) != 0;
+#endif
 
-    for (int i = 0; i < 3; i++) {
-        std::vector<std::pair<int, int> > row;
-        row.resize(MAX_TRIP_LENGTH, default_pair);
-        t_data.second[i] = row;
-        t_data.second[i][0] = std::make_pair(0, -1);
+    for (; k < end; k++) {
+        int cand = saturating_add(price, previous_price[k - shift]);
+
+        if (layer_price[k] > cand) {
+            layer_price[k] = cand;
+            layer_ticket[k] = id;
+            changed = true;
+        }
     }
+
+    return changed;
 }
 
 /**
- * Adds a new ticket to the ticket set.
- * 
- * @param ticket_name       Name of the ticket.
- * @param price             Price of the ticket.
- * @param expiration_time   Time before the ticket expires(in minutes).
- * 
- * @note    Complexity O(N) where N is the TICKET_SET_SIZE.
+ *  Obtains the first slot of a ticket name in the name index.
+ *
+ * @param mask              Size of the index minus one (the size
+ *                          is a power of two).
  */
-bool add_new_ticket(tickets_data& data, const std::string& ticket_name, const int price, int expiration_time) {
+inline size_t ticket_slot(std::string_view name, size_t mask) {
+    return std::hash<std::string_view>()(name) & mask;
+}
 
-    std::vector<ticket_info>& tickets = data.first;
-    std::vector<std::vector<std::pair<int, int> > >& optimal_ticket_set = data.second;
+/**
+ * Finds a ticket by its name.
+ *
+ * @return  The ID of the ticket, or -1 if there is no such ticket.
+ *
+ * @note    Expected complexity O(1).
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+int find_ticket(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, std::string_view name) {
+    const std::vector<uint32_t>& index = data.name_index;
+    if (index.empty())
+        return -1;
 
-    for (size_t i = 0; i < tickets.size(); i++)
-        if (ticket_name.compare(tickets[i].first) == 0)
-            return false;   // Ticket name is identical to some other ticket.
+    size_t mask = index.size() - 1;
+    for (size_t slot = ticket_slot(name, mask); index[slot] != 0; slot = (slot + 1) & mask)
+        if (data.tickets[index[slot] - 1].first == name)
+            return index[slot] - 1;
+    return -1;
+}
 
-    // Limits the espiration time.
-    if (expiration_time > MAX_TRIP_LENGTH)
-        expiration_time = MAX_TRIP_LENGTH;
+/**
+ * Adds the last ticket of the list to the name index. An index that
+ * would become more than half full is rebuilt twice as large first,
+ * without the removed tickets.
+ *
+ * @note    Amortized complexity O(1).
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void index_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data) {
+    std::vector<uint32_t>& index = data.name_index;
+    size_t count = data.tickets.size();
+    size_t first = count - 1;
 
-    // Adds ticket to the list and obtains it's id.
-    int id = tickets.size();
-    tickets.push_back(std::make_pair(ticket_name, expiration_time));
+    if (2 * count > index.size()) {
+        size_t size = std::max<size_t>(16, 2 * index.size());
+        while (size < 2 * count)
+            size *= 2;
+        index.assign(size, 0);
+        first = 0;
+    }
 
-    // Updates the best prices for trips using only one ticket.
-    for (int i = expiration_time; i > 0; i--) {
-        if (optimal_ticket_set[0][i].first > price)
-            optimal_ticket_set[0][i] = std::make_pair(price, id);
-        else
-            break;
+    size_t mask = index.size() - 1;
+    for (size_t id = first; id < count; id++) {
+        if (data.tickets[id].second == 0)
+            continue;   // A removed ticket.
+
+        size_t slot = ticket_slot(data.tickets[id].first, mask);
+        while (index[slot] != 0)
+            slot = (slot + 1) & mask;
+        index[slot] = id + 1;
     }
+}
 
-    // Updates the best prices for trips using at least two tickets.
-    for (int i = 1; i < 3; i++)
-        for (size_t j = expiration_time + 1; j <= MAX_TRIP_LENGTH; j++) {
-            int tickets_price = (int)std::min((long long)INT_MAX, price + (long long) optimal_ticket_set[i - 1][j - expiration_time].first);
+/**
+ * Removes a ticket from the name index, shifting back the tickets
+ * that follow it in their probe sequences so that no slot on any
+ * of them becomes empty.
+ *
+ * @note    Expected complexity O(1).
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void unindex_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, int id) {
+    std::vector<uint32_t>& index = data.name_index;
+    size_t mask = index.size() - 1;
 
-            if (optimal_ticket_set[i][j].first > tickets_price)
-                optimal_ticket_set[i][j] = std::make_pair(tickets_price, id);
+    size_t hole = ticket_slot(data.tickets[id].first, mask);
+    while (index[hole] != (uint32_t)id + 1)
+        hole = (hole + 1) & mask;
+
+    for (size_t slot = (hole + 1) & mask; index[slot] != 0; slot = (slot + 1) & mask) {
+        // A ticket may fill the hole if its first slot does not lie
+        // after the hole on the way to its slot.
+        size_t first = ticket_slot(data.tickets[index[slot] - 1].first, mask);
+        if (((slot - first) & mask) >= ((slot - hole) & mask)) {
+            index[hole] = index[slot];
+            hole = slot;
         }
+    }
+    index[hole] = 0;
+}
 
-    return true;
+/**
+ * Checks whether the ticket 'a' is preferred to the ticket 'b': it is
+ * cheaper, or as cheap and older.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+bool is_preferred_ticket(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, int a, int b) {
+    cents price_a = data.ticket_prices[a], price_b = data.ticket_prices[b];
+    return price_a < price_b || (price_a == price_b && a < b);
 }
 
 /**
- * Calculates the cheapest possible ticket set
- * for the given trip length.
- * 
- * @param   Length of the trip.
- * 
- * @return  A vector containing names of the tickets that
- *      can last for the length of the trip and are the cheapest.
- *      If there is no such a set, or the trip length is less or equal to zero,
- *      or it is greater than the MAX_TRIP_LENGTH; an empty
- *      vector is returned. 
- * 
- * @note    Complexity O(1).
+ * Adds a ticket to the bucket of its expiration time.
  */
-std::vector<std::string> optimal_ticket_set(const tickets_data& t_data, const int trip_length) {
+template <int MAX_TICKETS, int MAX_LENGTH>
+void bucket_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, int id) {
+    int& first = data.bucket_first[data.tickets[id].second];
+    std::vector<int>& next = data.bucket_next;
 
-    // A vector containing ticket data
-    const std::vector<ticket_info>& tickets = t_data.first;
-    
-    // An array of vectors. Each of the vectors represents best possible
-    // price for a given time(vector[i][k] = pair<best price for i + 1 tickets
-    // and the time equals to k, id of the latest used ticket to produce the price>).
-    const std::vector<std::vector<std::pair<int, int> > >& optimal_ticket_set = t_data.second;
+    if (first < 0 || is_preferred_ticket(data, id, first)) {
+        next[id] = first;
+        first = id;
+    }
+    else {
+        next[id] = next[first];
+        next[first] = id;
+    }
+}
 
-    std::vector<std::string> out;
+/**
+ * Removes a ticket from the bucket of its expiration time.
+ *
+ * @note    Complexity O(B) where B is the size of the bucket.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void unbucket_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, int id) {
+    int& first = data.bucket_first[data.tickets[id].second];
+    std::vector<int>& next = data.bucket_next;
 
-    // Checks whether the trip length(time) is within the limits.
-    if (trip_length > MAX_TRIP_LENGTH || trip_length <= 0)
-        return out;
+    if (first != id) {
+        int before = first;
+        while (next[before] != id)
+            before = next[before];
+        next[before] = next[id];
+        return;
+    }
 
-    int tickets_count = 0;
-    int best_price = INT_MAX;
+    // Moves the cheapest of the remaining tickets to the front.
+    first = next[id];
+    if (first < 0)
+        return;
 
-    // Finds how many tickets to buy.
-    for (int i = 0; i < 3; i++) {
-        if (optimal_ticket_set[i][trip_length].first < best_price) 
-            tickets_count = i + 1;
-        best_price = std::min(best_price, optimal_ticket_set[i][trip_length].first);
+    int best = first, before_best = -1;
+    for (int before = first; next[before] >= 0; before = next[before])
+        if (is_preferred_ticket(data, next[before], best)) {
+            best = next[before];
+            before_best = before;
+        }
+
+    if (before_best >= 0) {
+        next[before_best] = next[best];
+        next[best] = first;
+        first = best;
     }
+}
 
-    // Checks whether there exist at least one valid
-    // set of the tickets that can last for the trip.
-    if (tickets_count == 0) 
-        return out;
+/**
+ * Evicts the cached replies for trips of at least 'shortest' minutes
+ * after the table of best prices changed, keeping the shorter ones.
+ * A reply only depends on the table at its trip length and below.
+ *
+ * @param version           Version of the ticket data before the change.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void evict_ticket_set_replies(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& data,
+                              unsigned version, int shortest) {
+    ticket_reply_cache& cache = data.reply_cache;
+    if (cache.version != version || cache.replies.empty())
+        return;    // Dropped as a whole by 'ticket_set_reply' anyway.
 
-    // Obtains names of the tickets from the set.
-    int pos = trip_length;
-    while (pos > 0) {
-        int next_id = optimal_ticket_set[tickets_count - 1][pos].second;
+    for (size_t k = shortest; k < cache.replies.size(); k++)
+        cache.replies[k].clear();
+    cache.version = data.version;
+}
 
-        out.push_back(tickets[next_id].first);
-        pos -= tickets[next_id].second;
-        tickets_count--;
+/**
+ * Updates the table of best prices with the ticket 'id' as the latest
+ * one of the ticket set.
+ *
+ * A ticket that is not cheaper than some ticket lasting at least as long
+ * (i.e. that does not improve the best price for a single ticket) never
+ * produces a better ticket set, so the table is left as it is. Otherwise
+ * only trips from the shortest one it became the best single ticket for
+ * can change. The layers are updated in turn until one does not change:
+ * a cheaper set of more tickets with the new one would contain a cheaper
+ * set of fewer tickets with it.
+ *
+ * @return  The shortest trip whose best price changed, or max_length() + 1
+ *          if the table is left as it is.
+ *
+ * @note    Complexity O(T * L) where T is the maximal number of tickets
+ *          in a set and L is the maximal trip length, O(1) for
+ *          a dominated ticket.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+int relax_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, int id) {
+    const int max_length = data.max_length();
+    const int price = data.ticket_prices[id].value;
+    const int expiration_time = data.tickets[id].second;
+
+    int* single_price = data.price(0);
+    int* single_ticket = data.ticket(0);
+    if (single_price[expiration_time] <= price)
+        return max_length + 1;
+
+    // Updates the best prices for trips using only one ticket.
+    int shortest = expiration_time;
+    for (; shortest > 0 && single_price[shortest] > price; shortest--) {
+        single_price[shortest] = price;
+        single_ticket[shortest] = id;
     }
 
-    return out;
+    // Updates the best prices for trips using at least two tickets.
+    for (int i = 1; i < data.max_tickets(); i++)
+        if (!relax_layer(data.price(i), data.ticket(i), data.price(i - 1), price, id,
+                         expiration_time, expiration_time + 1, max_length + 1))
+            break;
+
+    return shortest + 1;
 }
 
 /**
- * Checks whether the ticket set was found.
+ * Appends a ticket, whose name is known to be unique, to the ticket set
+ * and updates the table of best prices (see 'relax_ticket').
+ * 
+ * @param ticket_name       Name of the ticket.
+ * @param price             Price of the ticket.
+ * @param expiration_time   Time before the ticket expires(in minutes).
+ * 
+ * @note    Complexity O(T * L) where T is the maximal number of tickets
+ *          in a set and L is the maximal trip length, O(1) apart from
+ *          the name index for a dominated ticket.
  */
-bool ticket_set_found(std::vector<std::string> tickets) {
-    if (tickets.size() == 0)
-        return false;
+template <int MAX_TICKETS, int MAX_LENGTH>
+void insert_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data,
+                   std::string_view ticket_name, const cents price, int expiration_time) {
+
+    std::vector<ticket_info>& tickets = data.tickets;
+    const int max_length = data.max_length();
+
+    // Limits the espiration time.
+    if (expiration_time > max_length)
+        expiration_time = max_length;
+
+    // Adds ticket to the list and obtains it's id.
+    int id = tickets.size();
+    tickets.push_back(std::make_pair(std::string(ticket_name), expiration_time));
+    data.ticket_prices.push_back(price);
+    data.bucket_next.push_back(-1);
+    index_ticket(data);
+    bucket_ticket(data, id);
+
+    unsigned version = data.version;
+    int shortest = relax_ticket(data, id);
+    if (shortest > max_length) {
+        KASA_COUNT(TICKETS_DOMINATED);
+        return;
+    }
+
+    data.version++;
+    evict_ticket_set_replies(data, version, shortest);
+}
+
+/**
+ * Adds a new ticket to the ticket set.
+ * 
+ * @param ticket_name       Name of the ticket.
+ * @param price             Price of the ticket.
+ * @param expiration_time   Time before the ticket expires(in minutes).
+ * 
+ * @return  False if a ticket with the same name already exists.
+ *
+ * @note    Expected complexity O(T * L) where T is the maximal number
+ *          of tickets in a set and L is the maximal trip length.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+bool add_new_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data,
+                    std::string_view ticket_name, const cents price, int expiration_time) {
+
+    if (find_ticket(data, ticket_name) >= 0)
+        return false;   // Ticket name is identical to some other ticket.
+
+    insert_ticket(data, ticket_name, price, expiration_time);
     return true;
 }
 
-//route part
+/**
+ * Checks whether the ticket 'id', with the given price and expiration
+ * time, leaves the table as it is when the tickets are added in the order
+ * of their IDs: some older ticket lasting at least as long is at most
+ * as expensive (see 'relax_ticket'). A removed ticket is never added.
+ *
+ * @note    Complexity O(L + B) where L is the maximal trip length and B
+ *          is the size of the buckets whose cheapest ticket is at most
+ *          as expensive.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+bool is_skipped_ticket(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& data,
+                       int id, const cents price, int expiration_time) {
+    if (expiration_time == 0)
+        return true;
+
+    for (int time = expiration_time; time <= data.max_length(); time++) {
+        int first = data.bucket_first[time];
+        if (first < 0 || price < data.ticket_prices[first])
+            continue;   // No ticket of the bucket is at most as expensive.
+
+        for (int other = first; other >= 0; other = data.bucket_next[other])
+            if (other < id && data.ticket_prices[other] <= price)
+                return true;
+    }
+    return false;
+}
+
+/**
+ * Recomputes the table of best prices by adding the tickets again in the
+ * order of their IDs, skipping the removed ones. The table is then the
+ * same as for the remaining tickets added to an empty ticket set, down to
+ * the tickets chosen among equally cheap sets.
+ *
+ * The whole table is recomputed on purpose. A ticket lasting E minutes
+ * can be the best single ticket for any trip up to E minutes, so the
+ * shortest changed trip is often 1 anyway. And the ticket kept among
+ * equally cheap sets depends on the entries the older tickets left for
+ * shorter trips, so recomputing only the longer trips from the best
+ * tickets of the buckets gives other tickets than a fresh replay.
+ *
+ * @return  The shortest trip whose price or ticket in the table changed,
+ *          or max_length() + 1 if the table did not change.
+ *
+ * @note    Complexity O(N + K * T * L) where N is the number of tickets,
+ *          K is the number of them that are not dominated by older ones,
+ *          T is the maximal number of tickets in a set and L is the maximal
+ *          trip length.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+int rebuild_ticket_layers(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data) {
+    const int max_length = data.max_length();
+
+    // The old layers are kept to find the changes, new ones are filled in.
+    const simd_array prices = std::exchange(data.prices, simd_array(data.prices.size(), INT_MAX));
+    const simd_array ids = std::exchange(data.ids, simd_array(data.ids.size(), -1));
+    for (int i = 0; i < data.max_tickets(); i++)
+        data.price(i)[0] = 0;
+
+    for (int id = 0; id < (int)data.tickets.size(); id++)
+        if (data.tickets[id].second > 0)
+            relax_ticket(data, id);
+
+    for (int k = 1; k <= max_length; k++)
+        for (int i = 0; i < data.max_tickets(); i++) {
+            size_t pos = (size_t)i * data.stride() + k;
+            if (data.prices[pos] != prices[pos] || data.ids[pos] != ids[pos])
+                return k;
+        }
+    return max_length + 1;
+}
+
+/**
+ * Changes the price and the expiration time of a ticket, or removes it
+ * from the table for the expiration time 0, and updates the table.
+ *
+ * The table is recomputed by 'rebuild_ticket_layers' unless the ticket
+ * leaves it as it is both before and after the change (see
+ * 'is_skipped_ticket'), e.g. a ticket that is dominated by an older one.
+ * Only the replies for trips from the shortest one whose entry changed
+ * are evicted.
+ *
+ * @note    Complexity O(B + L) where B is the size of the buckets
+ *          of the ticket and L is the maximal trip length if the table
+ *          is left as it is, otherwise O(N + K * T * L) to recompute it
+ *          (see 'rebuild_ticket_layers').
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void change_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data,
+                   int id, const cents price, int expiration_time) {
+    const int max_length = data.max_length();
+    if (expiration_time > max_length)
+        expiration_time = max_length;
+
+    bool skipped = is_skipped_ticket(data, id, data.ticket_prices[id], data.tickets[id].second);
+
+    unbucket_ticket(data, id);
+    data.tickets[id].second = expiration_time;
+    data.ticket_prices[id] = price;
+    if (expiration_time > 0)
+        bucket_ticket(data, id);
+
+    if (skipped && is_skipped_ticket(data, id, price, expiration_time))
+        return;
+
+    unsigned version = data.version;
+    int shortest = rebuild_ticket_layers(data);
+    if (shortest > max_length)
+        return;
+
+    data.version++;
+    evict_ticket_set_replies(data, version, shortest);
+}
+
+/**
+ * Changes the price and the expiration time of a ticket.
+ *
+ * @param ticket_name       Name of the ticket.
+ * @param price             New price of the ticket.
+ * @param expiration_time   New time before the ticket expires(in minutes).
+ *
+ * @return  False if there is no ticket with the name.
+ *
+ * @note    See 'change_ticket' for the complexity.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+bool update_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data,
+                   std::string_view ticket_name, const cents price, int expiration_time) {
+    int id = find_ticket(data, ticket_name);
+    if (id < 0)
+        return false;
+
+    change_ticket(data, id, price, expiration_time);
+    return true;
+}
+
+/**
+ * Removes a ticket from the ticket set. A new ticket may take its name.
+ *
+ * @param ticket_name       Name of the ticket.
+ *
+ * @return  False if there is no ticket with the name.
+ *
+ * @note    See 'change_ticket' for the complexity.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+bool remove_ticket(ticket_planner<MAX_TICKETS, MAX_LENGTH>& data, std::string_view ticket_name) {
+    int id = find_ticket(data, ticket_name);
+    if (id < 0)
+        return false;
+
+    change_ticket(data, id, data.ticket_prices[id], 0);
+    unindex_ticket(data, id);
+    data.tickets[id].first = std::string();
+    return true;
+}
+
+/**
+ * Calculates the cheapest possible ticket set
+ * for the given trip length.
+ * 
+ * @param   Length of the trip.
+ * 
+ * @return  A vector containing names of the tickets that
+ *      can last for the length of the trip and are the cheapest.
+ *      If there is no such a set, or the trip length is less or equal to zero,
+ *      or it is greater than the maximal trip length; an empty
+ *      vector is returned. 
+ * 
+ * @note    Complexity O(T) where T is the maximal number of tickets in a set.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+std::vector<std::string> optimal_ticket_set(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data,
+                                            const int trip_length) {
+
+    // A vector containing ticket data
+    const std::vector<ticket_info>& tickets = t_data.tickets;
+
+    std::vector<std::string> out;
+
+    // Checks whether the trip length(time) is within the limits.
+    if (trip_length > t_data.max_length() || trip_length <= 0)
+        return out;
+
+    int tickets_count = 0;
+    int best_price = INT_MAX;
+
+    // Finds how many tickets to buy.
+    for (int i = 0; i < t_data.max_tickets(); i++) {
+        if (t_data.price(i)[trip_length] < best_price) 
+            tickets_count = i + 1;
+        best_price = std::min(best_price, t_data.price(i)[trip_length]);
+    }
+
+    // Checks whether there exist at least one valid
+    // set of the tickets that can last for the trip.
+    if (tickets_count == 0) 
+        return out;
+
+    // Obtains names of the tickets from the set.
+    int pos = trip_length;
+    while (pos > 0) {
+        int next_id = t_data.ticket(tickets_count - 1)[pos];
+
+        out.push_back(tickets[next_id].first);
+        pos -= tickets[next_id].second;
+        tickets_count--;
+    }
+
+    return out;
+}
+
+// Trip lengths a thread of 'optimal_ticket_sets' is given at least.
+const size_t MIN_BATCH_PART = 1 << 16;
+
+/**
+ * Calculates the cheapest ticket sets for the trips [begin, end)
+ * of a batch, see 'optimal_ticket_sets'.
+ *
+ * @note    Uses AVX2 gathers when available, for 8 trips at a time,
+ *          with a scalar fallback.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void optimal_ticket_sets_part(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data,
+                              const int* trip_lengths, size_t begin, size_t end,
+                              int* best_prices, int* ticket_ids) {
+    const int max_tickets = t_data.max_tickets();
+    const int max_length = t_data.max_length();
+    const std::vector<ticket_info>& tickets = t_data.tickets;
+
+    std::fill(ticket_ids + begin * max_tickets, ticket_ids + end * max_tickets, -1);
+    size_t t = begin;
+
+#if defined(__AVX2__)
+    // Expiration times are gathered from the ticket list itself,
+    // by the offsets of the tickets in bytes.
+    const char* expiration_times = tickets.empty() ? nullptr : (const char*)&tickets[0].second;
+    const __m256i no_price = _mm256_set1_epi32(INT_MAX);
+    const __m256i no_ticket = _mm256_set1_epi32(-1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+
+    for (; t + 8 <= end; t += 8) {
+        __m256i pos = _mm256_loadu_si256((const __m256i*)(trip_lengths + t));
+        __m256i valid = _mm256_and_si256(_mm256_cmpgt_epi32(pos, zero),
+                                         _mm256_cmpgt_epi32(_mm256_set1_epi32(max_length + 1), pos));
+
+        // Finds how many tickets to buy.
+        __m256i best = no_price;
+        __m256i count = zero;
+        for (int i = 0; i < max_tickets; i++) {
+            __m256i price = _mm256_mask_i32gather_epi32(no_price, t_data.price(i), pos, valid, 4);
+            __m256i better = _mm256_cmpgt_epi32(best, price);
+            best = _mm256_blendv_epi8(best, price, better);
+            count = _mm256_blendv_epi8(count, _mm256_set1_epi32(i + 1), better);
+        }
+        _mm256_storeu_si256((__m256i*)(best_prices + t), best);
+
+        // Obtains the IDs of the tickets from the set.
+        __m256i stride = _mm256_set1_epi32(t_data.stride());
+        for (int j = 0; j < max_tickets; j++) {
+            __m256i active = _mm256_and_si256(_mm256_cmpgt_epi32(count, zero),
+                                              _mm256_cmpgt_epi32(pos, zero));
+            if (_mm256_testz_si256(active, active))
+                break;
+
+            __m256i cell = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(count, one), stride), pos);
+            __m256i ids = _mm256_mask_i32gather_epi32(no_ticket, t_data.ids.data(), cell, active, 4);
+            __m256i offsets = _mm256_mullo_epi32(ids, _mm256_set1_epi32(sizeof(ticket_info)));
+            __m256i times = _mm256_mask_i32gather_epi32(zero, (const int*)expiration_times,
+                                                        offsets, active, 1);
+
+            alignas(32) int lanes[8];
+            _mm256_store_si256((__m256i*)lanes, ids);
+            for (int lane = 0; lane < 8; lane++)
+                ticket_ids[(t + lane) * max_tickets + j] = lanes[lane];
+
+            pos = _mm256_sub_epi32(pos, times);
+            count = _mm256_sub_epi32(count, _mm256_and_si256(active, one));
+        }
+    }
+#endif
+
+    for (; t < end; t++) {
+        int trip_length = trip_lengths[t];
+        int tickets_count = 0;
+        int best_price = INT_MAX;
+
+        if (trip_length > 0 && trip_length <= max_length)
+            for (int i = 0; i < max_tickets; i++)
+                if (t_data.price(i)[trip_length] < best_price) {
+                    tickets_count = i + 1;
+                    best_price = t_data.price(i)[trip_length];
+                }
+        best_prices[t] = best_price;
+
+        int* ids = ticket_ids + t * max_tickets;
+        for (int pos = trip_length; tickets_count > 0 && pos > 0; tickets_count--) {
+            int next_id = t_data.ticket(tickets_count - 1)[pos];
+            *ids++ = next_id;
+            pos -= tickets[next_id].second;
+        }
+    }
+}
+
+/**
+ * Calculates the cheapest ticket sets for a batch of trip lengths,
+ * like 'optimal_ticket_set' but by ticket IDs and without allocating.
+ * Large batches are split between threads.
+ *
+ * @param trip_lengths      The trip lengths, 'count' of them.
+ * @param best_prices       Set to the price of the set for every trip
+ *                          (in cents), or NO_PRICE if there is no set.
+ * @param ticket_ids        Set to max_tickets() IDs for every trip:
+ *                          the tickets in the order of 'optimal_ticket_set',
+ *                          followed by -1 for the unused places.
+ * @param threads           The maximal number of threads to use.
+ *
+ * @note    Complexity O(N * T) where N is the number of trips and T is
+ *          the maximal number of tickets in a set.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void optimal_ticket_sets(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data,
+                         const int* trip_lengths, size_t count,
+                         int* best_prices, int* ticket_ids, int threads = 1) {
+    size_t parts = std::max<size_t>(1, std::min<size_t>(threads, count / MIN_BATCH_PART));
+
+    std::vector<std::thread> workers;
+    for (size_t part = 1; part < parts; part++)
+        workers.emplace_back([&, part] {
+            optimal_ticket_sets_part(t_data, trip_lengths, count * part / parts,
+                                     count * (part + 1) / parts, best_prices, ticket_ids);
+        });
+
+    optimal_ticket_sets_part(t_data, trip_lengths, 0, count / parts, best_prices, ticket_ids);
+    for (auto& worker : workers)
+        worker.join();
+}
+
+/**
+ * Checks whether the ticket set was found.
+ */
+bool ticket_set_found(std::vector<std::string> tickets) {
+    if (tickets.size() == 0)
+        return false;
+    return true;
+}
+
+/**
+ * Renders the reply to a trip request for the given ticket set:
+ * "! name; name; ..." or ":|" if no set was found.
+ */
+std::string render_ticket_set(const std::vector<std::string>& tickets) {
+    if (ticket_set_found(tickets) == false)
+        return ":|";
+
+    std::string out = "! " + tickets.front();
+    for (auto i = ++tickets.begin(); i != tickets.end(); i++)
+        out += "; " + (*i);
+    return out;
+}
+
+/**
+ * Obtains the reply to a trip request for a trip of the given length
+ * from the cache of the ticket data, rendering it first if needed.
+ * 
+ * @param   Length of the trip.
+ * @param   Set to the number of tickets in the reply.
+ * 
+ * @return  The reply, as rendered by 'render_ticket_set'.
+ *          It stays valid until the ticket data changes.
+ * 
+ * @note    Complexity O(1), apart from the first request for the length
+ *          after the ticket data changed.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+const std::string& ticket_set_reply(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data,
+                                    const int trip_length, int& tickets_count) {
+    static const std::string not_found = ":|";
+    ticket_reply_cache& cache = t_data.reply_cache;
+
+    tickets_count = 0;
+    if (trip_length > t_data.max_length() || trip_length <= 0)
+        return not_found;
+
+    if (cache.version != t_data.version || cache.replies.empty()) {
+        cache.version = t_data.version;
+        cache.replies.assign(t_data.max_length() + 1, std::string());
+        cache.ticket_counts.assign(t_data.max_length() + 1, 0);
+    }
+
+    std::string& reply = cache.replies[trip_length];
+    if (reply.empty()) {
+        KASA_COUNT(REPLIES_RENDERED);
+        std::vector<std::string> tickets = optimal_ticket_set(t_data, trip_length);
+        reply = render_ticket_set(tickets);
+        cache.ticket_counts[trip_length] = tickets.size();
+    }
+
+    tickets_count = cache.ticket_counts[trip_length];
+    return reply;
+}
+
+/**
+ * Renders the replies for all trip lengths in advance. Until the ticket
+ * data changes, 'ticket_set_reply' then only reads the cache, so it can
+ * be called from many threads at once.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void render_ticket_set_replies(const ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data) {
+    int tickets_count;
+    for (int trip_length = 1; trip_length <= t_data.max_length(); trip_length++)
+        ticket_set_reply(t_data, trip_length, tickets_count);
+}
+
+//Output part
+
+// Default number of bytes an output_sink buffers before writing them out.
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
+// Buffered output to a file descriptor, written out once 'flush_size'
+// bytes are pending (and at the end of input). A sink 'merged' into
+// another one appends to that sink's buffer instead of its own, so that
+// the output of sinks writing to the same file keeps its relative order.
+struct output_sink {
+    int fd;
+    size_t flush_size = OUTPUT_BUFFER_SIZE;
+    std::string buffer;
+    output_sink* merged = nullptr;
+};
+
+// Standard output and standard error of the program.
+struct output_streams {
+    output_sink out;
+    output_sink err;
+};
+
+/**
+ *  Checks whether two file descriptors write to the same file, e.g.
+ *  the standard output and the standard error redirected with 2>&1.
+ */
+bool is_same_file(int fd, int other) {
+    struct stat info, other_info;
+    return fstat(fd, &info) == 0 && fstat(other, &other_info) == 0 &&
+           info.st_dev == other_info.st_dev && info.st_ino == other_info.st_ino;
+}
+
+/**
+ *  Prepares buffered output to the standard output and standard error.
+ *  If they go to the same file, the standard error is merged into
+ *  the standard output; otherwise their order is not observable.
+ *
+ * @param flush_size        Number of bytes buffered before writing them out.
+ */
+void open_outputs(output_streams& outputs, size_t flush_size) {
+    outputs.out.fd = STDOUT_FILENO;
+    outputs.err.fd = STDERR_FILENO;
+    if (is_same_file(STDOUT_FILENO, STDERR_FILENO))
+        outputs.err.merged = &outputs.out;
+
+    for (output_sink* sink : {&outputs.out, &outputs.err}) {
+        sink->flush_size = flush_size;
+        sink->buffer.reserve(flush_size);
+    }
+}
+
+/**
+ *  Writes out all the buffered output of the sink, including that
+ *  of the sink it is merged into.
+ */
+void flush_output(output_sink& sink) {
+    if (sink.merged != nullptr)
+        flush_output(*sink.merged);
+
+    size_t written = 0;
+
+    while (written < sink.buffer.size()) {
+        ssize_t count = write(sink.fd, sink.buffer.data() + written, sink.buffer.size() - written);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;  // The output is closed, nothing more can be done.
+        written += count;
+    }
+    sink.buffer.clear();
+}
+
+/**
+ *  Appends the text to the output of the sink.
+ */
+void write_output(output_sink& sink, std::string_view text) {
+    output_sink& target = sink.merged != nullptr ? *sink.merged : sink;
+
+    target.buffer.append(text);
+    if (target.buffer.size() >= target.flush_size)
+        flush_output(target);
+}
+
+/**
+ *  Appends the decimal representation of the number to the output
+ *  of the sink, without going through iostream formatting.
+ */
+void write_output(output_sink& sink, long long number) {
+    char digits[24];
+    char* pos = digits + sizeof(digits);
+    unsigned long long value = number < 0 ? 0 - (unsigned long long)number : number;
+
+    do {
+        *--pos = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    if (number < 0)
+        *--pos = '-';
+
+    write_output(sink, std::string_view(pos, digits + sizeof(digits) - pos));
+}
+
+//route part
+
+/**
+ * @short Obtains the identifier of a stop, interning its name if needed.
+ *
+ * @param   the dictionary of stop names
+ * @param   name of the stop
+ *
+ * @return  The identifier of the stop.
+ */
+stop_id intern_stop(stop_dictionary& dictionary, std::string_view name) {
+    auto found = dictionary.ids.find(name);
+    if(found != dictionary.ids.end()) return found->second;
+
+    stop_id id = dictionary.names.size();
+    dictionary.names.emplace_back(name);
+    dictionary.ids.emplace(dictionary.names.back(), id);
+    return id;
+}
+
+/**
+ * @short Forgets the stops interned after the dictionary had the given size.
+ *
+ * @param   the dictionary of stop names
+ * @param   number of stops to keep
+ */
+void forget_stops(stop_dictionary& dictionary, size_t kept) {
+    while (dictionary.names.size() > kept) {
+        dictionary.ids.erase(dictionary.names.back());
+        dictionary.names.pop_back();
+    }
+}
+
+/**
+ * @short Obtains the identifier of a stop without interning its name.
+ *
+ * @param   the dictionary of stop names
+ * @param   name of the stop
+ *
+ * @return  The identifier of the stop, or NO_STOP if no route visits it.
+ */
+stop_id find_stop(const stop_dictionary& dictionary, std::string_view name) {
+    auto found = dictionary.ids.find(name);
+    if(found == dictionary.ids.end()) return NO_STOP;
+    return found->second;
+}
+
+/**
+ * @short Inserts a stop into a stop_set.
+ *
+ * @param   the set
+ * @param   identifier of the stop
+ *
+ * @return  False if the stop was already in the set.
+ */
+bool insert_stop(stop_set& set, stop_id stop) {
+    size_t word = stop / 64;
+    uint64_t bit = (uint64_t)1 << (stop % 64);
+    if(word >= set.words.size()) set.words.resize(word + 1, 0);
+
+    if(set.words[word] & bit) return false;
+    set.words[word] |= bit;
+    return true;
+}
+
+/**
+ * @short Erases a stop from a stop_set.
+ *
+ * @param   the set
+ * @param   identifier of the stop, which is in the set
+ */
+void erase_stop(stop_set& set, stop_id stop) {
+    set.words[stop / 64] &= ~((uint64_t)1 << (stop % 64));
+}
+
+/**
+ * @short Checks the validity of a request of the first type.
+ * 
+ * Checks whether given data can constitute a valid request
+ * to add a new route to the system. 
+ * A valid request must satisfy the following criteria:
+ * 1) A route of given number must not already exist in the system;
+ * 2) No stop occurs twice on the route;
+ * 3) All arrival times are given in an increasing order.
+ * 
+ * @param   number (unique) of the route to be added
+ * @param   a vector of pairs <stop_id, arrival_time> describing the new route
+ * @param   the schedule of all existing bus routes
+ * @param   an empty set of stops, left empty
+ * 
+ * @return  The result of validity check. 
+ */
+bool is_valid_new_route(int route_number, const route_info& stops_on_route,
+                        const bus_schedule& schedule, stop_set& visited_stops) 
+{
+    if(schedule.route_ids.count(route_number) > 0)
+        return false;
+        
+    if(stops_on_route.size() == 0) return false;
+    
+    int last_stop_time = 0;
+    size_t checked = 0;
+    
+    for(; checked < stops_on_route.size(); checked++) {
+        const auto& stop = stops_on_route[checked];
+        
+        if(stop.second <= last_stop_time) break;
+        if(insert_stop(visited_stops, stop.first) == false) break;
+        last_stop_time = stop.second;
+    }
+    
+    for(size_t i = 0; i < checked; i++)
+        erase_stop(visited_stops, stops_on_route[i].first);
+    
+    return checked == stops_on_route.size();
+}
+
+/**
+ * @short Creates a new schedule_point object.
+ * 
+ * Creates a new schedule_point object based on given parameters.
+ * 
+ * @param   number of a bus route
+ * @param   identifier of a bus stop lying on the route
+ * 
+ * @return  The created schedule_point. 
+ */
+schedule_point create_schedule_point(int route, stop_id bus_stop) {
+    return std::make_pair(bus_stop, route);
+}
+
+/**
+ * @short Obtains the first slot of a stop in a route_timetable index.
+ *
+ * @param   identifier of the stop
+ * @param   size of the index minus one (the size is a power of two)
+ */
+size_t timetable_slot(stop_id stop, size_t mask) {
+    return (stop * 2654435761u) & mask;
+}
+
+/**
+ * @short Builds the hash index of a timetable from its stops.
+ *
+ * @param   the timetable, with the stops filled in
+ */
+void index_timetable(route_timetable& timetable) {
+    size_t index_size = 2;
+    while(index_size < 2 * timetable.stops.size()) index_size *= 2;
+    timetable.index.assign(index_size, 0);
+
+    for(size_t i = 0; i < timetable.stops.size(); i++) {
+        size_t slot = timetable_slot(timetable.stops[i].stop, index_size - 1);
+        while(timetable.index[slot] != 0) slot = (slot + 1) & (index_size - 1);
+        timetable.index[slot] = i + 1;
+    }
+}
+
+/**
+ * @short Builds the timetable of a route.
+ *
+ * @param   a vector of pairs <stop_id, arrival_time> describing the route
+ *
+ * @return  The timetable, with the hash index filled in.
+ */
+route_timetable create_timetable(const route_info& stops_on_route) {
+    route_timetable timetable;
+    timetable.stops.reserve(stops_on_route.size());
+    for(auto i = stops_on_route.begin(); i != stops_on_route.end(); i++)
+        timetable.stops.push_back(route_stop{(*i).first, (*i).second});
+
+    index_timetable(timetable);
+    return timetable;
+}
+
+/**
+ * @short Adds a new route
+ * 
+ * Fulfils a request to add a new route according to the parameters.
+ * 
+ * @param   number (unique) of the route to be added
+ * @param   a vector of pairs <stop_id, arrival_time> describing the new route  
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * @param   an empty set of stops, left empty
+ * 
+ * @return  False if given arguments do not constitute a valid new route 
+ *          (in which case nothing is added). Otherwise true.
+ */
+bool add_new_route(int route_number, const route_info& stops_on_route, 
+                   bus_schedule& schedule, stop_set& visited_stops) 
+{
+    if(is_valid_new_route(route_number, stops_on_route, 
+                          schedule, visited_stops) == false) return false;
+                          
+    schedule.route_ids[route_number] = schedule.timetables.size();
+    schedule.timetables.push_back(create_timetable(stops_on_route));
+    schedule.version++;
+    return true;
+}
+
+// New routes staged with 'stage_new_route': their stops, one route
+// after another, and the end of each route in 'stops'. They get their
+// positions in 'timetables' (and their numbers in 'route_ids') when
+// staged, but their timetables only in 'flush_route_batch'.
+struct route_batch {
+    std::vector<route_stop> stops;
+    std::vector<uint32_t> ends;
+
+    // The maximal number of threads building the timetables.
+    int threads = 1;
+};
+
+// Routes a thread of 'flush_route_batch' is given at least.
+const size_t MIN_ROUTE_BATCH_PART = 1024;
+
+/**
+ * @short Stages a new route
+ *
+ * Validates a request to add a new route like 'add_new_route', but only
+ * appends the route to the batch; it is added by 'flush_route_batch'.
+ * Routes staged in the same batch count as existing ones in the check.
+ *
+ * @param   number (unique) of the route to be added
+ * @param   a vector of pairs <stop_id, arrival_time> describing the new route
+ * @param   the schedule the route is added to
+ * @param   an empty set of stops, left empty
+ * @param   the batch of routes staged for the schedule
+ *
+ * @return  False if given arguments do not constitute a valid new route
+ *          (in which case nothing is staged). Otherwise true.
+ *
+ * @note    Until the batch is flushed, the schedule must not be searched.
+ */
+bool stage_new_route(int route_number, const route_info& stops_on_route,
+                     bus_schedule& schedule, stop_set& visited_stops, route_batch& batch)
+{
+    if(is_valid_new_route(route_number, stops_on_route,
+                          schedule, visited_stops) == false) return false;
+
+    schedule.route_ids[route_number] = schedule.timetables.size() + batch.ends.size();
+    for(auto i = stops_on_route.begin(); i != stops_on_route.end(); i++)
+        batch.stops.push_back(route_stop{(*i).first, (*i).second});
+    batch.ends.push_back(batch.stops.size());
+    return true;
+}
+
+/**
+ * @short Adds the routes staged in a batch
+ *
+ * Builds the timetables of the staged routes at once, splitting large
+ * batches between threads, and empties the batch.
+ *
+ * @param   the schedule the routes were staged for
+ * @param   the batch
+ */
+void flush_route_batch(bus_schedule& schedule, route_batch& batch) {
+    if(batch.ends.empty()) return;
+
+    size_t first = schedule.timetables.size();
+    size_t count = batch.ends.size();
+    schedule.timetables.resize(first + count);
+
+    auto build = [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            route_timetable& timetable = schedule.timetables[first + i];
+            uint32_t stops_begin = i == 0 ? 0 : batch.ends[i - 1];
+            timetable.stops.assign(batch.stops.begin() + stops_begin,
+                                   batch.stops.begin() + batch.ends[i]);
+            index_timetable(timetable);
+        }
+    };
+
+    size_t parts = std::max<size_t>(1, std::min<size_t>(batch.threads, count / MIN_ROUTE_BATCH_PART));
+    std::vector<std::thread> workers;
+    for(size_t part = 1; part < parts; part++)
+        workers.emplace_back(build, count * part / parts, count * (part + 1) / parts);
+
+    build(0, count / parts);
+    for(auto& worker : workers)
+        worker.join();
+
+    schedule.version++;
+    batch.stops.clear();
+    batch.ends.clear();
+}
+
+/**
+ * @short Finds the arrival time of a route at a stop in its timetable.
+ *
+ * @param   the timetable of the route
+ * @param   identifier of the stop
+ *
+ * @return  The arrival time, or NO_TIME if the route does not stop there.
+ */
+int timetable_arrival_time(const route_timetable& timetable, stop_id bus_stop) {
+    size_t mask = timetable.index.size() - 1;
+
+    for(size_t slot = timetable_slot(bus_stop, mask);
+        timetable.index[slot] != 0;
+        slot = (slot + 1) & mask)
+    {
+        const route_stop& stop = timetable.stops[timetable.index[slot] - 1];
+        if(stop.stop == bus_stop) return stop.time;
+    }
+    return NO_TIME;
+}
+
+/**
+ * @short Finds the arrival time of a route at a stop.
+ *
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * @param   the pair <bus_stop, bus_route> to look up
+ *
+ * @return  The arrival time, or NO_TIME if the route does not exist
+ *          or does not stop at the stop.
+ */
+int arrival_time(const bus_schedule& schedule, schedule_point point) {
+    auto route = schedule.route_ids.find(point.second);
+    if(route == schedule.route_ids.end()) return NO_TIME;
+
+    return timetable_arrival_time(schedule.timetables[route->second], point.first);
+}
+
+bool contains(const bus_schedule& schedule, schedule_point k){
+    return arrival_time(schedule, k) != NO_TIME;
+}
+
+// Result of evaluating a trip request with 'evaluate_trip'.
+struct trip_evaluation {
+    // Whether the trip is valid (see 'check_trip_validity').
+    bool valid;
+
+    // Time the entire trip takes.
+    minute travel_time;
+
+    // The first stop of the trip where waiting is required,
+    // or NO_STOP if the trip needs no waiting.
+    stop_id wait_stop;
+};
+
+/**
+ * @short Evaluates a request of the third type in a single pass.
+ * 
+ * Every hop of the trip looks its route up once, and the departure and
+ * arrival times of the hop once each. The pass checks the validity of
+ * the trip (see 'check_trip_validity') and, for a valid trip, finds its
+ * travel time and the first stop where waiting would be required.
+ * 
+ * @param   a vector containing a sequence of stops
+ * @param   a vector containing the sequence of routes intended to use 
+ *          for travel between the stops
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * 
+ * @return  The evaluation. Its times and stop are meaningful only
+ *          if the trip is valid.
+ */
+trip_evaluation evaluate_trip(const std::vector<stop_id>& stops, 
+                              const std::vector<int>& routes,
+                              const bus_schedule& schedule)
+{
+    trip_evaluation result = {false, 0, NO_STOP};
+
+    if(stops.size() < 2) return result;
+    if(routes.size() < 1 ) return result;
+    if(stops.size() != routes.size() + 1) return result;
+
+    int first_departure = NO_TIME;
+    int last_arrival = NO_TIME;
+
+    for(size_t hop = 0; hop < routes.size(); hop++) {
+        auto route = schedule.route_ids.find(routes[hop]);
+        if(route == schedule.route_ids.end()) return result;
+
+        const route_timetable& timetable = schedule.timetables[route->second];
+        int departure = timetable_arrival_time(timetable, stops[hop]);
+        int arrival = timetable_arrival_time(timetable, stops[hop + 1]);
+
+        if(departure == NO_TIME || arrival == NO_TIME) return result;
+        if(departure > arrival) return result;
+
+        if(hop == 0) {
+            first_departure = departure;
+        }
+        else {
+            if(last_arrival > departure) return result;
+            if(result.wait_stop == NO_STOP && last_arrival != departure)
+                result.wait_stop = stops[hop];
+        }
+        last_arrival = arrival;
+    }
+
+    result.valid = true;
+    result.travel_time = (minute)(last_arrival - first_departure);
+    return result;
+}
+
+/**
+ * @short Checks the validity of a request of the third type.
+ * 
+ * Checks whether given data can constitute a valid request
+ * to find the optimal ticket buying strategy.
+ * A valid request must satisfy the following criteria:
+ * 1) The number of stops given must be equal to the number of connecting
+ *    routes given + 1; there need to be at least one connection, 
+ *    which constitutes a minimum of two stops and one route.
+ * 2) All given routes must exist in the schedule and include respective stops.
+ * 3) Given order of stops and routes must imply a non-decreasing order 
+ *    of the respective arrival and departure times, according to the schedule.
+ * 
+ * @param   a vector containing a sequence of stops
+ * @param   a vector containing the sequence of routes intended to use 
+ *          for travel between the stops
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * 
+ * @return  The result of validity check. 
+ */
+bool check_trip_validity (const std::vector<stop_id>& stops, 
+                          const std::vector<int>& routes,
+                          const bus_schedule& schedule) 
+{
+    return evaluate_trip(stops, routes, schedule).valid;
+}
+
+// Default number of bytes a trip_cache may use.
+const size_t TRIP_CACHE_SIZE = 1 << 20;
+
+// Position of no entry in a trip_cache.
+const uint32_t NO_ENTRY = UINT32_MAX;
+
+// Longest key of a trip_cache entry. Trips with longer keys
+// (of more than 8 stops) are not cached.
+const size_t TRIP_KEY_SIZE = 16;
+
+// An evaluated trip, linked into the list of entries from the most
+// to the least recently used. The key holds the number of stops,
+// the stops and the routes of the trip.
+struct trip_cache_entry {
+    uint32_t key[TRIP_KEY_SIZE];
+    uint32_t key_size;
+    uint64_t hash;
+    trip_evaluation result;
+    uint32_t newer = NO_ENTRY;
+    uint32_t older = NO_ENTRY;
+};
+
+// Memory used by a trip_cache entry, including its slots in the index.
+const size_t TRIP_CACHE_ENTRY_SIZE = sizeof(trip_cache_entry) + 2 * sizeof(uint32_t);
+
+// Least recently used cache of 'evaluate_trip' results, with as many
+// entries as fit in 'memory_limit' bytes. The results depend only on
+// the routes, so the cache is dropped whenever the schedule version
+// changes; replies for the evaluated trips come from the ticket data,
+// which keeps its own cache. 'index' is an open-addressing hash index
+// of the entries, with NO_ENTRY in empty slots, kept at most half full.
+// All memory is allocated with the first entry, and evicted entries
+// are reused, so the cache does not allocate afterwards.
+struct trip_cache {
+    size_t memory_limit = TRIP_CACHE_SIZE;
+    unsigned schedule_version = 0;
+
+    std::vector<trip_cache_entry> entries;
+    std::vector<uint32_t> index;
+    uint32_t newest = NO_ENTRY;
+    uint32_t oldest = NO_ENTRY;
+};
+
+/**
+ * @short Hashes the key of a trip_cache entry.
+ */
+uint64_t trip_key_hash(const uint32_t* key, size_t key_size) {
+    uint64_t hash = key_size;
+    for(size_t i = 0; i < key_size; i++) {
+        hash = (hash + key[i]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/**
+ * @short Finds the slot of a trip_cache index holding the entry
+ *        with the hash, or the empty slot where it would be.
+ */
+size_t find_trip_slot(const trip_cache& cache, uint64_t hash) {
+    size_t mask = cache.index.size() - 1;
+    size_t slot = hash & mask;
+
+    while(cache.index[slot] != NO_ENTRY && cache.entries[cache.index[slot]].hash != hash)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+/**
+ * @short Empties a slot of a trip_cache index, moving back the entries
+ *        probed past it so that they can still be found.
+ */
+void erase_trip_slot(trip_cache& cache, size_t slot) {
+    size_t mask = cache.index.size() - 1;
+
+    for(size_t next = (slot + 1) & mask; cache.index[next] != NO_ENTRY; next = (next + 1) & mask) {
+        size_t home = cache.entries[cache.index[next]].hash & mask;
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            cache.index[slot] = cache.index[next];
+            slot = next;
+        }
+    }
+    cache.index[slot] = NO_ENTRY;
+}
+
+/**
+ * @short Unlinks an entry from the list of a trip_cache.
+ */
+void unlink_trip_entry(trip_cache& cache, uint32_t pos) {
+    trip_cache_entry& entry = cache.entries[pos];
+
+    if(entry.newer != NO_ENTRY) cache.entries[entry.newer].older = entry.older;
+    else cache.newest = entry.older;
+    if(entry.older != NO_ENTRY) cache.entries[entry.older].newer = entry.newer;
+    else cache.oldest = entry.newer;
+
+    entry.newer = entry.older = NO_ENTRY;
+}
+
+/**
+ * @short Links an entry as the most recently used one of a trip_cache.
+ */
+void link_newest_trip_entry(trip_cache& cache, uint32_t pos) {
+    trip_cache_entry& entry = cache.entries[pos];
+
+    entry.older = cache.newest;
+    entry.newer = NO_ENTRY;
+    if(cache.newest != NO_ENTRY) cache.entries[cache.newest].newer = pos;
+    else cache.oldest = pos;
+    cache.newest = pos;
+}
+
+/**
+ * @short Evaluates a request of the third type, reusing the result
+ *        of an identical earlier request if it is cached.
+ *
+ * @param   the cache of evaluated trips
+ * @param   a vector containing a sequence of stops
+ * @param   a vector containing the sequence of routes intended to use 
+ *          for travel between the stops
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ *
+ * @return  The evaluation, as by 'evaluate_trip'.
+ */
+trip_evaluation cached_evaluate_trip(trip_cache& cache,
+                                     const std::vector<stop_id>& stops, 
+                                     const std::vector<int>& routes,
+                                     const bus_schedule& schedule)
+{
+    size_t capacity = cache.memory_limit / TRIP_CACHE_ENTRY_SIZE;
+    size_t key_size = 1 + stops.size() + routes.size();
+    if(key_size > TRIP_KEY_SIZE || capacity == 0)
+        return evaluate_trip(stops, routes, schedule);
+
+    if(cache.index.empty()) {
+        size_t index_size = 2;
+        while(index_size < 2 * capacity) index_size *= 2;
+        cache.index.assign(index_size, NO_ENTRY);
+        cache.entries.reserve(capacity);
+    }
+
+    if(cache.schedule_version != schedule.version) {
+        cache.entries.clear();
+        cache.index.assign(cache.index.size(), NO_ENTRY);
+        cache.newest = cache.oldest = NO_ENTRY;
+        cache.schedule_version = schedule.version;
+    }
+
+    uint32_t key[TRIP_KEY_SIZE];
+    key[0] = stops.size();
+    std::copy(stops.begin(), stops.end(), key + 1);
+    std::copy(routes.begin(), routes.end(), key + 1 + stops.size());
+    uint64_t hash = trip_key_hash(key, key_size);
+
+    size_t slot = find_trip_slot(cache, hash);
+    uint32_t pos = cache.index[slot];
+    if(pos != NO_ENTRY) {
+        trip_cache_entry& entry = cache.entries[pos];
+        if(entry.key_size == key_size && std::equal(key, key + key_size, entry.key)) {
+            KASA_COUNT(TRIP_CACHE_HITS);
+            unlink_trip_entry(cache, pos);
+            link_newest_trip_entry(cache, pos);
+            return entry.result;
+        }
+    }
+
+    KASA_COUNT(TRIP_CACHE_MISSES);
+    trip_evaluation result = evaluate_trip(stops, routes, schedule);
+
+    // Reuses a colliding entry, the least recently used one if the cache
+    // is full, or a new one.
+    if(pos == NO_ENTRY && cache.entries.size() == capacity) {
+        pos = cache.oldest;
+        erase_trip_slot(cache, find_trip_slot(cache, cache.entries[pos].hash));
+        slot = find_trip_slot(cache, hash);
+    }
+    if(pos == NO_ENTRY) {
+        pos = cache.entries.size();
+        cache.entries.emplace_back();
+    }
+    else {
+        unlink_trip_entry(cache, pos);
+    }
+
+    trip_cache_entry& entry = cache.entries[pos];
+    std::copy(key, key + key_size, entry.key);
+    entry.key_size = key_size;
+    entry.hash = hash;
+    entry.result = result;
+    link_newest_trip_entry(cache, pos);
+    cache.index[slot] = pos;
+
+    return result;
+}
+
+// route part
+
+/**
+ * Provides an answer for a third type request. Writes the result 
+ * to standard output, according to the task specification 
+ * at https://moodle.mimuw.edu.pl/mod/assign/view.php?id=19131.
+ * 
+ * @param   vector of stops to visit in the order of visit
+ * @param   vector of routes used to travel between consecutive pairs of stops, 
+ *          in the respective order
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * @param   the dictionary of stop names, used to print the results
+ * @param   the cache of evaluated trips
+ * @param   the sink to write the result to
+ *
+ * @return False if the request was invalid. True otherwise.
+ */
+bool plan_tickets(const std::vector<stop_id>& stops, 
+                  const std::vector<int>& routes, 
+                  const bus_schedule& schedule,
+                  const stop_dictionary& dictionary,
+                  const tickets_data& t_data,
+                  int& tickets_sold,
+                  trip_cache& trips,
+                  output_sink& out)
+{    
+    trip_evaluation trip = cached_evaluate_trip(trips, stops, routes, schedule);
+    if(trip.valid == false) return false;
+    
+    if(trip.wait_stop != NO_STOP){
+        write_output(out, ":( ");
+        write_output(out, dictionary.names[trip.wait_stop]);
+        write_output(out, "\n");
+        return true;
+    }
+
+    int tickets_count;
+    const std::string& reply = ticket_set_reply(t_data, trip.travel_time + 1, tickets_count);
+
+    tickets_sold += tickets_count;
+    write_output(out, reply);
+    write_output(out, "\n");
+    return true;
+}
+
+
+// A ride of a route between two consecutive stops. 'from_state' and
+// 'to_state' identify the pairs <stop, time> of its ends, so that rides
+// ending and starting at the same stop at the same time share a state.
+struct route_connection {
+    minute departure;
+    minute arrival;
+    stop_id from;
+    stop_id to;
+    uint32_t route;
+    uint32_t from_state;
+    uint32_t to_state;
+};
+
+// Index of all rides of the schedule sorted by departure time, built
+// for the schedule version 'schedule_version', with the state of the
+// searches made with it. A mark is set if it equals 'search', so that
+// nothing has to be cleared between searches.
+struct journey_planner {
+    bool built = false;
+    unsigned schedule_version = 0;
+    std::vector<route_connection> connections;
+
+    unsigned search = 0;
+    std::vector<unsigned> route_marks;
+    std::vector<minute> route_starts;
+    std::vector<unsigned> state_marks;
+    std::vector<minute> state_starts;
+};
+
+// Result of 'earliest_journey': the departure from the first stop and
+// the arrival at the last one (in minutes since midnight).
+struct journey {
+    bool found;
+    int departure;
+    int arrival;
+};
+
+/**
+ * @short Builds the index of rides of a journey_planner.
+ *
+ * @param   the planner
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ */
+void build_journey_planner(journey_planner& planner, const bus_schedule& schedule) {
+    std::unordered_map<uint64_t, uint32_t> states;
+    auto state_of = [&](const route_stop& stop) {
+        uint64_t key = (uint64_t)stop.stop << 32 | (uint32_t)stop.time;
+        return states.emplace(key, states.size()).first->second;
+    };
+
+    planner.connections.clear();
+    for(uint32_t route = 0; route < schedule.timetables.size(); route++) {
+        const std::vector<route_stop>& stops = schedule.timetables[route].stops;
+        for(size_t i = 0; i + 1 < stops.size(); i++)
+            planner.connections.push_back(route_connection{
+                (minute)stops[i].time, (minute)stops[i + 1].time, stops[i].stop, stops[i + 1].stop,
+                route, state_of(stops[i]), state_of(stops[i + 1])});
+    }
+
+    std::stable_sort(planner.connections.begin(), planner.connections.end(),
+                     [](const route_connection& a, const route_connection& b) {
+                         return a.departure < b.departure;
+                     });
+
+    planner.search = 0;
+    planner.route_marks.assign(schedule.timetables.size(), 0);
+    planner.route_starts.assign(schedule.timetables.size(), 0);
+    planner.state_marks.assign(states.size(), 0);
+    planner.state_starts.assign(states.size(), 0);
+
+    planner.built = true;
+    planner.schedule_version = schedule.version;
+}
+
+/**
+ * @short Finds the journey that arrives first at a stop, leaving another
+ *        one at or after a given time, without waiting on the way.
+ * 
+ * Scans the rides in the order of departure (connection scan). A rider
+ * may stay on a route, board it at the first stop, or change to it where
+ * another route arrives at the very time it departs (the journey would
+ * need waiting otherwise, see 'evaluate_trip'). Of the journeys arriving
+ * first, the one leaving last (the shortest one) is chosen.
+ * 
+ * @param   the planner, rebuilt if the schedule changed
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * @param   the first stop
+ * @param   the last stop
+ * @param   the earliest departure time
+ * 
+ * @return  The journey, if it was found.
+ */
+journey earliest_journey(journey_planner& planner, const bus_schedule& schedule,
+                         stop_id origin, stop_id destination, int earliest_departure)
+{
+    if(!planner.built || planner.schedule_version != schedule.version)
+        build_journey_planner(planner, schedule);
+
+    if(++planner.search == 0) {
+        std::fill(planner.route_marks.begin(), planner.route_marks.end(), 0);
+        std::fill(planner.state_marks.begin(), planner.state_marks.end(), 0);
+        planner.search = 1;
+    }
+    unsigned search = planner.search;
+
+    journey result = {false, NO_TIME, NO_TIME};
+    auto first = std::lower_bound(planner.connections.begin(), planner.connections.end(),
+                                  earliest_departure,
+                                  [](const route_connection& c, int time) {
+                                      return c.departure < time;
+                                  });
+
+    for(auto c = first; c != planner.connections.end(); c++) {
+        // Later rides arrive after the best arrival found.
+        if(result.found && c->departure >= result.arrival) break;
+
+        int start = NO_TIME;
+        if(planner.route_marks[c->route] == search)
+            start = planner.route_starts[c->route];
+        if(c->from == origin)
+            start = std::max<int>(start, c->departure);
+        if(planner.state_marks[c->from_state] == search)
+            start = std::max<int>(start, planner.state_starts[c->from_state]);
+        if(start == NO_TIME) continue;
+
+        planner.route_marks[c->route] = search;
+        planner.route_starts[c->route] = (minute)start;
+
+        if(planner.state_marks[c->to_state] != search || planner.state_starts[c->to_state] < start) {
+            planner.state_marks[c->to_state] = search;
+            planner.state_starts[c->to_state] = (minute)start;
+        }
+
+        if(c->to == destination &&
+           (!result.found || c->arrival < result.arrival ||
+            (c->arrival == result.arrival && start > result.departure)))
+            result = journey{true, start, c->arrival};
+    }
+
+    return result;
+}
+
+/**
+ * Provides an answer for an earliest journey request. Writes the tickets
+ * for the journey found by 'earliest_journey' like 'plan_tickets' does,
+ * or ":(" if there is no journey without waiting.
+ * 
+ * @param   the first stop
+ * @param   the last stop
+ * @param   the earliest departure time
+ * @param   the structure representing all existing relations of bus stops 
+ *          and routes in the form of bus schedule
+ * @param   the planner of journeys
+ * @param   the sink to write the result to
+ *
+ * @return False if the request was invalid (a stop is not on any route).
+ *         True otherwise.
+ */
+bool plan_earliest_journey(stop_id origin, stop_id destination, int earliest_departure,
+                           const bus_schedule& schedule,
+                           journey_planner& planner,
+                           const tickets_data& t_data,
+                           int& tickets_sold,
+                           output_sink& out)
+{
+    if(origin == NO_STOP || destination == NO_STOP) return false;
+
+    journey trip = earliest_journey(planner, schedule, origin, destination, earliest_departure);
+    if(trip.found == false) {
+        write_output(out, ":(\n");
+        return true;
+    }
+
+    int tickets_count;
+    const std::string& reply = ticket_set_reply(t_data, trip.arrival - trip.departure + 1, tickets_count);
+
+    tickets_sold += tickets_count;
+    write_output(out, reply);
+    write_output(out, "\n");
+    return true;
+}
+
+
+//Parser part
+
+// Size of the buffer of a line_arena. Lines needing more memory
+// for temporaries continue on the heap.
+const size_t LINE_ARENA_SIZE = 1 << 16;
+
+// Monotonic arena for the temporaries of processing a single line,
+// released by 'release_line_arena' once the line is processed.
+struct line_arena {
+    std::unique_ptr<char[]> buffer{new char[LINE_ARENA_SIZE]};
+    std::pmr::monotonic_buffer_resource resource{buffer.get(), LINE_ARENA_SIZE};
+};
+
+// Tokens of a single input line, as produced by the 'lex_*' functions.
+// String views point into the processed line. The vectors are reused
+// from line to line, so lexing does not allocate once they have grown.
+struct line_tokens {
+    // New route: number of the route and pairs <stop_name, arrival_time>.
+    int route_number;
+    std::vector<std::pair<std::string_view, int> > route_stops;
+
+    // New ticket: name, price and expiration time (in minutes).
+    // Ticket update: the same. Ticket removal: the name.
+    std::string_view ticket_name;
+    cents price;
+    int expiration_time;
+
+    // Trip request: stops to visit and routes connecting them.
+    // Earliest journey request: the first and last stops.
+    std::vector<std::string_view> stops;
+    std::vector<int> routes;
+
+    // Earliest journey request: the earliest departure time (in minutes).
+    int departure_time;
+
+    // Buffer for the stops of a trip request, resolved to identifiers.
+    std::vector<stop_id> stop_ids;
+
+    // Memory for the temporaries of running the request.
+    line_arena arena;
+
+    // Scratch set for checking the stops of a new route.
+    stop_set visited_stops;
+
+    // Trips evaluated for earlier requests read with these tokens.
+    trip_cache trips;
+
+    // Index for the earliest journey requests read with these tokens.
+    journey_planner journeys;
+};
+
+/**
+ *  Frees the temporaries of the processed line at once.
+ */
+void release_line_arena(line_tokens& tokens) {
+    tokens.arena.resource.release();
+}
+
+/**
+ *  Reports an invalid line. Lines of the main input are numbered alone,
+ *  lines of a source file (see 'load_source_files') with its name.
+ */
+void report_error(output_sink& err, std::string_view txt, int line_num,
+                  std::string_view source = std::string_view()) {
+    write_output(err, "Error in line ");
+    write_output(err, line_num);
+    if (source.size() != 0) {
+        write_output(err, " of ");
+        write_output(err, source);
+    }
+    write_output(err, ":");
+    write_output(err, txt);
+    write_output(err, "\n");
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_letter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool is_stop_name_char(char c) {
+    return is_letter(c) || c == '_' || c == '^';
+}
+
+/**
+ *  Consumes the character 'c' if it is the next one in the text.
+ */
+bool scan_char(std::string_view text, size_t& pos, char c) {
+    if (pos >= text.size() || text[pos] != c)
+        return false;
+    pos++;
+    return true;
+}
+
+/**
+ *  Consumes a [0-9]+ token. Fails if the value does not fit in an int.
+ */
+bool scan_number(std::string_view text, size_t& pos, int& value) {
+    size_t start = pos;
+    long long out = 0;
+
+    while (pos < text.size() && is_digit(text[pos])) {
+        out = out * 10 + (text[pos] - '0');
+        if (out > INT_MAX)
+            return false;
+        pos++;
+    }
+
+    value = (int)out;
+    return pos > start;
+}
+
+/**
+ *  Consumes a [1-9][0-9]* token. Fails if the value does not fit in an int.
+ */
+bool scan_positive_number(std::string_view text, size_t& pos, int& value) {
+    if (pos >= text.size() || text[pos] == '0')
+        return false;
+    return scan_number(text, pos, value);
+}
+
+/**
+ *  Consumes a [_\^A-Za-z]+ token.
+ */
+bool scan_stop_name(std::string_view text, size_t& pos, std::string_view& name) {
+    size_t start = pos;
+
+    while (pos < text.size() && is_stop_name_char(text[pos]))
+        pos++;
+
+    name = text.substr(start, pos - start);
+    return pos > start;
+}
+
+// Value of a character that is not a digit in DIGIT_VALUES.
+const uint8_t NOT_DIGIT = 0xFF;
+
+constexpr std::array<uint8_t, 256> make_digit_values() {
+    std::array<uint8_t, 256> values = {};
+    for (int c = 0; c < 256; c++)
+        values[c] = c >= '0' && c <= '9' ? c - '0' : NOT_DIGIT;
+    return values;
+}
+
+// Value of every character as a digit (NOT_DIGIT for other characters).
+constexpr std::array<uint8_t, 256> DIGIT_VALUES = make_digit_values();
+
+// An arrival time read by 'read_clock_time': minutes since midnight and
+// the number of characters it takes, or NO_TIME and 0 if it is invalid.
+struct clock_time {
+    int minutes;
+    size_t length;
+};
+
+/**
+ *  Reads an arrival time in the H:MM or HH:MM format (hours without
+ *  a leading zero) that lies between FIRST_ARRIVAL and LAST_ARRIVAL,
+ *  from the start of the text. Every character is converted through
+ *  DIGIT_VALUES, which also rejects the non-digits.
+ */
+constexpr clock_time read_clock_time(std::string_view text) {
+    const clock_time invalid = {NO_TIME, 0};
+    size_t p = 0;
+
+    if (p >= text.size() || DIGIT_VALUES[(unsigned char)text[p]] - 1u >= 9)
+        return invalid;
+
+    unsigned hours = DIGIT_VALUES[(unsigned char)text[p++]];
+    if (p < text.size() && DIGIT_VALUES[(unsigned char)text[p]] != NOT_DIGIT)
+        hours = hours * 10 + DIGIT_VALUES[(unsigned char)text[p++]];
+
+    if (p + 3 > text.size() || text[p] != ':')
+        return invalid;
+
+    unsigned tens = DIGIT_VALUES[(unsigned char)text[p + 1]];
+    unsigned ones = DIGIT_VALUES[(unsigned char)text[p + 2]];
+    if (tens >= 6 || ones == NOT_DIGIT)
+        return invalid;
+
+    unsigned minutes = hours * 60 + tens * 10 + ones;
+    if (minutes < (unsigned)FIRST_ARRIVAL || minutes > (unsigned)LAST_ARRIVAL)
+        return invalid;
+
+    return clock_time{(int)minutes, p + 3};
+}
+
+static_assert(read_clock_time("5:55").minutes == FIRST_ARRIVAL, "first arrival");
+static_assert(read_clock_time("21:21").minutes == LAST_ARRIVAL, "last arrival");
+static_assert(read_clock_time("12:07 A").length == 5, "two digits of hours");
+static_assert(read_clock_time("5:54").length == 0 && read_clock_time("21:22").length == 0,
+              "outside of the window");
+static_assert(read_clock_time("05:55").length == 0 && read_clock_time("9:60").length == 0 &&
+              read_clock_time("9:5").length == 0 && read_clock_time("1a:00").length == 0,
+              "malformed");
+
+/**
+ *  Consumes an arrival time (see 'read_clock_time').
+ *
+ * @param minutes   The time converted to minutes since midnight.
+ */
+bool scan_time(std::string_view text, size_t& pos, int& minutes) {
+    clock_time time = read_clock_time(std::string_view(text.data() + pos, text.size() - pos));
+    if (time.length == 0)
+        return false;
+
+    minutes = time.minutes;
+    pos += time.length;
+    return true;
+}
+
+// Kinds of lines, told apart by their first character: every rule
+// of the grammar (see regexy.txt) starts with characters of its own.
+enum line_kind : uint8_t {
+    LINE_INVALID,
+    LINE_ROUTE,     // A digit.
+    LINE_TICKET,    // A letter.
+    LINE_UPDATE,    // '='.
+    LINE_REMOVE,    // '-'.
+    LINE_QUERY,     // '?', of a best ticket set or an earliest journey ("?@").
+};
+
+constexpr std::array<line_kind, 256> make_line_kinds() {
+    std::array<line_kind, 256> kinds = {};
+    for (int c = 0; c < 256; c++)
+        kinds[c] = c >= '0' && c <= '9' ? LINE_ROUTE
+                 : (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ? LINE_TICKET
+                 : c == '=' ? LINE_UPDATE
+                 : c == '-' ? LINE_REMOVE
+                 : c == '?' ? LINE_QUERY : LINE_INVALID;
+    return kinds;
+}
+
+// Kind of a line by its first character.
+constexpr std::array<line_kind, 256> LINE_KINDS = make_line_kinds();
+
+/**
+ *  Obtains the kind of the line, i.e. the only lexer that can accept it.
+ */
+line_kind classify_line(std::string_view line) {
+    return line.empty() ? LINE_INVALID : LINE_KINDS[(unsigned char)line[0]];
+}
+
+/**
+ *  Checks whether the line is a new route request and if so
+ *  splits it into tokens.
+ *  Grammar: [0-9]+( TIME [_\^A-Za-z]+)*
+ */
+bool lex_new_route(std::string_view text, line_tokens& tokens) {
+    size_t pos = 0;
+
+    tokens.route_stops.clear();
+    if (!scan_number(text, pos, tokens.route_number))
+        return false;
+
+    while (pos < text.size()) {
+        int time;
+        std::string_view stop;
+
+        if (!scan_char(text, pos, ' ') || !scan_time(text, pos, time) ||
+            !scan_char(text, pos, ' ') || !scan_stop_name(text, pos, stop))
+            return false;
+
+        tokens.route_stops.push_back(std::make_pair(stop, time));
+    }
+
+    return true;
+}
+
+/**
+ *  Checks whether the line is a new ticket request and if so
+ *  splits it into tokens.
+ *  Grammar: [A-Za-z][ A-Za-z]* [1-9][0-9]*\.[0-9]{2} [1-9][0-9]*
+ */
+bool lex_new_ticket(std::string_view text, line_tokens& tokens) {
+    size_t pos = 0;
+
+    if (text.empty() || !is_letter(text[0]))
+        return false;
+
+    // Ticket names contain no digits, so the name ends
+    // right before the space that precedes the price.
+    while (pos < text.size() && (is_letter(text[pos]) || text[pos] == ' '))
+        pos++;
+
+    if (pos < 2 || text[pos - 1] != ' ')
+        return false;
+    tokens.ticket_name = text.substr(0, pos - 1);
+
+    int units;
+    if (!scan_positive_number(text, pos, units) || !scan_char(text, pos, '.'))
+        return false;
+
+    if (pos + 2 > text.size() || !is_digit(text[pos]) || !is_digit(text[pos + 1]))
+        return false;
+    int hundredths = (text[pos] - '0') * 10 + (text[pos + 1] - '0');
+    pos += 2;
+
+    if (units > (NO_PRICE.value - hundredths) / 100)
+        return false;   // The price does not fit in cents.
+    tokens.price = cents{units * 100 + hundredths};
+
+    if (!scan_char(text, pos, ' ') || pos >= text.size() || text[pos] == '0')
+        return false;
+
+    // Expiration times are capped by add_new_ticket anyway,
+    // so values that do not fit in an int are saturated.
+    if (!scan_number(text, pos, tokens.expiration_time)) {
+        while (pos < text.size() && is_digit(text[pos]))
+            pos++;
+        tokens.expiration_time = INT_MAX;
+    }
+
+    return pos == text.size();
+}
+
+/**
+ *  Checks whether the line is a ticket update request and if so
+ *  splits it into tokens.
+ *  Grammar: = [A-Za-z][ A-Za-z]* [1-9][0-9]*\.[0-9]{2} [1-9][0-9]*
+ */
+bool lex_update_ticket(std::string_view text, line_tokens& tokens) {
+    size_t pos = 0;
+
+    return scan_char(text, pos, '=') && scan_char(text, pos, ' ') &&
+           lex_new_ticket(text.substr(pos), tokens);
+}
+
+/**
+ *  Checks whether the line is a ticket removal request and if so
+ *  splits it into tokens.
+ *  Grammar: - [A-Za-z][ A-Za-z]*
+ */
+bool lex_remove_ticket(std::string_view text, line_tokens& tokens) {
+    size_t pos = 0;
+
+    if (!scan_char(text, pos, '-') || !scan_char(text, pos, ' ') ||
+        pos >= text.size() || !is_letter(text[pos]))
+        return false;
+    tokens.ticket_name = text.substr(pos);
+
+    while (pos < text.size() && (is_letter(text[pos]) || text[pos] == ' '))
+        pos++;
+    return pos == text.size();
+}
+
+/**
+ *  Checks whether the line is a best ticket set request and if so
+ *  splits it into tokens.
+ *  Grammar: \?( [_\^A-Za-z]+ [0-9]+)+ [_\^A-Za-z]+
+ */
+bool lex_plan_tickets(std::string_view text, line_tokens& tokens) {
+    size_t pos = 0;
+
+    tokens.stops.clear();
+    tokens.routes.clear();
+    if (!scan_char(text, pos, '?'))
+        return false;
+
+    while (true) {
+        std::string_view stop;
+        if (!scan_char(text, pos, ' ') || !scan_stop_name(text, pos, stop))
+            return false;
+        tokens.stops.push_back(stop);
+
+        if (pos == text.size())
+            break;
+
+        int route;
+        if (!scan_char(text, pos, ' ') || !scan_number(text, pos, route))
+            return false;
+        tokens.routes.push_back(route);
+    }
+
+    return tokens.routes.size() > 0;
+}
+
+/**
+ *  Checks whether the line is an earliest journey request and if so
+ *  splits it into tokens.
+ *  Grammar: \?@ [_\^A-Za-z]+ TIME [_\^A-Za-z]+
+ */
+bool lex_earliest_journey(std::string_view text, line_tokens& tokens) {
+    size_t pos = 0;
+    std::string_view origin, destination;
+
+    tokens.stops.clear();
+    if (!scan_char(text, pos, '?') || !scan_char(text, pos, '@') ||
+        !scan_char(text, pos, ' ') || !scan_stop_name(text, pos, origin) ||
+        !scan_char(text, pos, ' ') || !scan_time(text, pos, tokens.departure_time) ||
+        !scan_char(text, pos, ' ') || !scan_stop_name(text, pos, destination) ||
+        pos != text.size())
+        return false;
+
+    tokens.stops.push_back(origin);
+    tokens.stops.push_back(destination);
+    return true;
+}
+
+/**
+ *  Converts tokens to a valid format for the new route function.
+ *  And then invokes it with the given input, or stages the route
+ *  in 'staged' if given (see 'stage_new_route').
+ */
+bool parse_and_run_new_route(routes_data& r_data, line_tokens& tokens,
+                             route_batch* staged = nullptr) {
+    stage_timer timer(STAGE_ROUTE);
+    KASA_COUNT(LINES_ROUTE);
+
+    //Loads data to the container
+    size_t known_stops = r_data.stops.names.size();
+    route_info info(&tokens.arena.resource);
+    info.reserve(tokens.route_stops.size());
+    for (auto& stop : tokens.route_stops)
+        info.push_back(std::make_pair(intern_stop(r_data.stops, stop.first), stop.second));
+
+    //Invokes the function.
+    bool added = staged != nullptr
+        ? stage_new_route(tokens.route_number, info, r_data.schedule, tokens.visited_stops, *staged)
+        : add_new_route(tokens.route_number, info, r_data.schedule, tokens.visited_stops);
+    if (added)
+        return true;
+
+    //A rejected route must not leave its stop names behind.
+    forget_stops(r_data.stops, known_stops);
+    if (r_data.schedule.route_ids.count(tokens.route_number) > 0)
+        KASA_COUNT(REJECT_DUPLICATE_ROUTE);
+    else
+        KASA_COUNT(REJECT_INVALID_ROUTE);
+    return false;
+}
+
+/**
+ *  Converts tokens to a valid format for the new ticket function.
+ *  And then invokes the function with the given input.
+ */
+bool parse_and_run_new_ticket(tickets_data& t_data, const line_tokens& tokens) {
+    stage_timer timer(STAGE_TICKETS);
+    KASA_COUNT(LINES_TICKET);
+
+    //Invokes the function.
+    if (add_new_ticket(t_data, tokens.ticket_name, tokens.price, tokens.expiration_time))
+        return true;
+
+    KASA_COUNT(REJECT_DUPLICATE_TICKET);
+    return false;
+}
+
+/**
+ *  Converts tokens to a valid format for the ticket update function.
+ *  And then invokes the function with the given input.
+ */
+bool parse_and_run_update_ticket(tickets_data& t_data, const line_tokens& tokens) {
+    stage_timer timer(STAGE_TICKETS);
+    KASA_COUNT(LINES_TICKET);
+
+    //Invokes the function.
+    if (update_ticket(t_data, tokens.ticket_name, tokens.price, tokens.expiration_time))
+        return true;
+
+    KASA_COUNT(REJECT_UNKNOWN_TICKET);
+    return false;
+}
+
+/**
+ *  Converts tokens to a valid format for the ticket removal function.
+ *  And then invokes the function with the given input.
+ */
+bool parse_and_run_remove_ticket(tickets_data& t_data, const line_tokens& tokens) {
+    stage_timer timer(STAGE_TICKETS);
+    KASA_COUNT(LINES_TICKET);
+
+    //Invokes the function.
+    if (remove_ticket(t_data, tokens.ticket_name))
+        return true;
+
+    KASA_COUNT(REJECT_UNKNOWN_TICKET);
+    return false;
+}
+
+/**
+ *  Checks whether the line is a ticket update or removal request
+ *  and if so invokes the corresponding function.
+ *
+ * @param err   Set to true if the request failed.
+ *
+ * @return  False if the line is neither of the requests.
+ */
+bool process_ticket_change_line(tickets_data& t_data, line_tokens& tokens,
+                                std::string_view line, bool& err) {
+    if (lex_update_ticket(line, tokens))
+        err = !parse_and_run_update_ticket(t_data, tokens);
+    else if (lex_remove_ticket(line, tokens))
+        err = !parse_and_run_remove_ticket(t_data, tokens);
+    else
+        return false;
+    return true;
+}
+
+/**
+ *  Converts tokens to a valid format for the best ticket set function.
+ *  And then invokes the function with the given input.
+ */
+bool parse_and_run_plan_tickets(const routes_data& r_data, const tickets_data& t_data, int& tickets_sold,
+                                line_tokens& tokens, output_sink& out) {
+
+    // Stops that were never interned do not lie on any route,
+    // so they fail the validity check as NO_STOP.
+    std::vector<stop_id>& stops = tokens.stop_ids;
+    stops.clear();
+    for (auto& stop : tokens.stops)
+        stops.push_back(find_stop(r_data.stops, stop));
+
+    // Invokes the function.
+    return plan_tickets(stops, tokens.routes, r_data.schedule, r_data.stops, t_data, tickets_sold,
+                        tokens.trips, out);
+}
+
+/**
+ *  Converts tokens to a valid format for the earliest journey function.
+ *  And then invokes the function with the given input.
+ */
+bool parse_and_run_earliest_journey(const routes_data& r_data, const tickets_data& t_data,
+                                    int& tickets_sold, line_tokens& tokens, output_sink& out) {
+    stop_id origin = find_stop(r_data.stops, tokens.stops[0]);
+    stop_id destination = find_stop(r_data.stops, tokens.stops[1]);
+
+    // Invokes the function.
+    return plan_earliest_journey(origin, destination, tokens.departure_time, r_data.schedule,
+                                 tokens.journeys, t_data, tickets_sold, out);
+}
+
+/**
+ *  Processes a line that is neither a new route nor a ticket request
+ *  (new, update or removal), i.e. one that does not modify the data:
+ *  a best ticket set request, an earliest journey request or an invalid line.
+ */
+void process_query_line(const routes_data& r_data, const tickets_data& t_data, int& tickets_sold,
+                        line_tokens& tokens, output_streams& outputs,
+                        std::string_view line, int line_num) {
+    bool err;
+    bool journey = line.size() > 1 && line[1] == '@';
+
+    if (!journey && lex_plan_tickets(line, tokens)) {
+        stage_timer timer(STAGE_PLAN);
+        KASA_COUNT(LINES_QUERY);
+        err = !parse_and_run_plan_tickets(r_data, t_data, tickets_sold, tokens, outputs.out);
+        if (err)
+            KASA_COUNT(REJECT_INVALID_TRIP);
+    }
+    else if (journey && lex_earliest_journey(line, tokens)) {
+        stage_timer timer(STAGE_PLAN);
+        KASA_COUNT(LINES_QUERY);
+        err = !parse_and_run_earliest_journey(r_data, t_data, tickets_sold, tokens, outputs.out);
+        if (err)
+            KASA_COUNT(REJECT_INVALID_TRIP);
+    }
+    else {
+        KASA_COUNT(REJECT_SYNTAX);
+        err = true;
+    }
+
+    if (err)
+        report_error(outputs.err, line, line_num + 1);
+
+    release_line_arena(tokens);
+}
+
+/**
+ *  Checks if the line is in propper format and
+ *  if so invokes a corresponding function.
+ *  The first character of the line selects the only lexer to try.
+ *  New routes are staged in 'staged' (their errors are found at once),
+ *  which is flushed before any request reading the schedule.
+ */
+void process_line(routes_data& r_data, tickets_data& t_data, int& tickets_sold,
+                  line_tokens& tokens, route_batch& staged,
+                  output_streams& outputs, std::string_view line, int line_num) {
+    KASA_SAMPLE_LINE();
+    stage_timer timer(STAGE_LINE);
+    bool err = false;
+    line_kind kind = classify_line(line);
+
+    if (kind == LINE_TICKET && lex_new_ticket(line, tokens)) {
+        err = !parse_and_run_new_ticket(t_data, tokens);
+    }
+    else if (kind == LINE_ROUTE && lex_new_route(line, tokens)) {
+        err = !parse_and_run_new_route(r_data, tokens, &staged);
+    }
+    else if (kind == LINE_QUERY) {
+        flush_route_batch(r_data.schedule, staged);
+        process_query_line(r_data, t_data, tickets_sold, tokens, outputs, line, line_num);
+    }
+    else if (!process_ticket_change_line(t_data, tokens, line, err)) {
+        KASA_COUNT(REJECT_SYNTAX);
+        err = true;
+    }
+
+    if (err)
+        report_error(outputs.err, line, line_num + 1);
+
+    release_line_arena(tokens);
+}
+
+//Memory report part
+
+// Footprint of the data, by structure, written to the standard error
+// at exit with the --memory option and by a server on request.
+// Counting of all the heap memory of the process completes it when
+// compiled in with -DKASA_TRACK_MEMORY=1, replacing the global operator new.
+#ifndef KASA_TRACK_MEMORY
+#define KASA_TRACK_MEMORY 0
+#endif
+
+#if KASA_TRACK_MEMORY
+// Bytes and blocks held on the heap, and the most bytes held at once.
+std::atomic<size_t> heap_bytes{0};
+std::atomic<size_t> heap_blocks{0};
+std::atomic<size_t> heap_peak_bytes{0};
+
+/**
+ *  Counts a block allocated on the heap, or fails with std::bad_alloc.
+ */
+void* track_allocation(void* ptr) {
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+
+    size_t bytes = heap_bytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed) +
+                   malloc_usable_size(ptr);
+    heap_blocks.fetch_add(1, std::memory_order_relaxed);
+
+    size_t peak = heap_peak_bytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !heap_peak_bytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+    }
+    return ptr;
+}
+
+/**
+ *  Frees a block counted by 'track_allocation'.
+ */
+void track_free(void* ptr) {
+    if (ptr == nullptr)
+        return;
+
+    heap_bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+    heap_blocks.fetch_sub(1, std::memory_order_relaxed);
+    free(ptr);
+}
+
+void* operator new(size_t size) {
+    return track_allocation(malloc(size != 0 ? size : 1));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+// Over-aligned allocations, made by simd_allocator and std::pmr.
+void* operator new(size_t size, std::align_val_t alignment) {
+    size_t align = static_cast<size_t>(alignment);
+    return track_allocation(aligned_alloc(align, (size + align - 1) / align * align + (size == 0) * align));
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size, alignment);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void operator delete(void* ptr) noexcept {
+    track_free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    track_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    track_free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    track_free(ptr);
+}
+#endif
+
+// Structures whose memory is reported, with their names in the report.
+enum memory_category {
+    MEMORY_STOPS,
+    MEMORY_TIMETABLES,
+    MEMORY_ROUTE_IDS,
+    MEMORY_TICKETS,
+    MEMORY_TICKET_INDEX,
+    MEMORY_BEST_PRICES,
+    MEMORY_REPLY_CACHE,
+    MEMORY_TRIP_CACHE,
+    MEMORY_JOURNEYS,
+    MEMORY_PARSER,
+    MEMORY_OUTPUTS,
+    MEMORY_SNAPSHOTS,
+    MEMORY_CATEGORY_COUNT
+};
+
+const char* const MEMORY_NAMES[MEMORY_CATEGORY_COUNT] = {
+    "stops", "timetables", "route_ids", "tickets", "ticket_index", "best_prices",
+    "reply_cache", "trip_cache", "journeys", "parser", "outputs", "snapshots",
+};
+
+// Heap memory held by a structure: its bytes and the blocks they are in.
+struct memory_usage {
+    size_t bytes = 0;
+    size_t blocks = 0;
+};
+
+// Heap memory held by each of the reported structures. The memory of
+// node-based containers is estimated from their sizes, as they are laid
+// out by libstdc++; the sizes of the structures themselves are not included.
+struct memory_report {
+    memory_usage usage[MEMORY_CATEGORY_COUNT];
+};
+
+/**
+ *  Counts the array of a vector.
+ */
+template <typename T, typename Allocator>
+void count_vector(memory_usage& usage, const std::vector<T, Allocator>& vector) {
+    if (vector.capacity() == 0)
+        return;
+    usage.bytes += vector.capacity() * sizeof(T);
+    usage.blocks++;
+}
+
+/**
+ *  Counts the characters of a string, unless they are kept in the string
+ *  object itself (the small string optimization).
+ */
+void count_string(memory_usage& usage, const std::string& text) {
+    const char* object = reinterpret_cast<const char*>(&text);
+    if (text.data() >= object && text.data() < object + sizeof(text))
+        return;
+    usage.bytes += text.capacity() + 1;
+    usage.blocks++;
+}
+
+/**
+ *  Counts the buffers and the map of a deque, of 512 bytes each.
+ */
+template <typename T>
+void count_deque(memory_usage& usage, const std::deque<T>& deque) {
+    size_t per_buffer = std::max<size_t>(1, 512 / sizeof(T));
+    size_t buffers = deque.size() / per_buffer + 1;
+
+    usage.bytes += buffers * per_buffer * sizeof(T) + std::max<size_t>(8, buffers + 2) * sizeof(T*);
+    usage.blocks += buffers + 1;
+}
+
+/**
+ *  Counts the buckets and the nodes of an unordered map; a node holds
+ *  the link to the next one, the value and (at most) the hash.
+ */
+template <typename Map>
+void count_hash_map(memory_usage& usage, const Map& map) {
+    if (map.bucket_count() > 1) {
+        usage.bytes += map.bucket_count() * sizeof(void*);
+        usage.blocks++;
+    }
+    usage.bytes += map.size() * (sizeof(void*) + sizeof(typename Map::value_type) + sizeof(size_t));
+    usage.blocks += map.size();
+}
+
+/**
+ *  Counts the memory of the stops and the schedule.
+ */
+void count_routes_memory(memory_report& report, const routes_data& r_data) {
+    memory_usage& stops = report.usage[MEMORY_STOPS];
+    count_deque(stops, r_data.stops.names);
+    for (auto& name : r_data.stops.names)
+        count_string(stops, name);
+    count_hash_map(stops, r_data.stops.ids);
+
+    memory_usage& timetables = report.usage[MEMORY_TIMETABLES];
+    count_vector(timetables, r_data.schedule.timetables);
+    for (auto& timetable : r_data.schedule.timetables) {
+        count_vector(timetables, timetable.stops);
+        count_vector(timetables, timetable.index);
+    }
+
+    count_hash_map(report.usage[MEMORY_ROUTE_IDS], r_data.schedule.route_ids);
+}
+
+/**
+ *  Counts the memory of the tickets, the table of best prices
+ *  and the cache of replies.
+ */
+template <int MAX_TICKETS, int MAX_LENGTH>
+void count_tickets_memory(memory_report& report, const ticket_planner<MAX_TICKETS, MAX_LENGTH>& t_data) {
+    memory_usage& tickets = report.usage[MEMORY_TICKETS];
+    count_vector(tickets, t_data.tickets);
+    for (auto& ticket : t_data.tickets)
+        count_string(tickets, ticket.first);
+    count_vector(tickets, t_data.ticket_prices);
+
+    memory_usage& index = report.usage[MEMORY_TICKET_INDEX];
+    count_vector(index, t_data.name_index);
+    count_vector(index, t_data.bucket_first);
+    count_vector(index, t_data.bucket_next);
+
+    count_vector(report.usage[MEMORY_BEST_PRICES], t_data.prices);
+    count_vector(report.usage[MEMORY_BEST_PRICES], t_data.ids);
+
+    memory_usage& replies = report.usage[MEMORY_REPLY_CACHE];
+    count_vector(replies, t_data.reply_cache.replies);
+    for (auto& reply : t_data.reply_cache.replies)
+        count_string(replies, reply);
+    count_vector(replies, t_data.reply_cache.ticket_counts);
+}
+
+/**
+ *  Counts the memory of the buffers and caches kept with the tokens.
+ */
+void count_tokens_memory(memory_report& report, const line_tokens& tokens) {
+    count_vector(report.usage[MEMORY_TRIP_CACHE], tokens.trips.entries);
+    count_vector(report.usage[MEMORY_TRIP_CACHE], tokens.trips.index);
+
+    memory_usage& journeys = report.usage[MEMORY_JOURNEYS];
+    count_vector(journeys, tokens.journeys.connections);
+    count_vector(journeys, tokens.journeys.route_marks);
+    count_vector(journeys, tokens.journeys.route_starts);
+    count_vector(journeys, tokens.journeys.state_marks);
+    count_vector(journeys, tokens.journeys.state_starts);
+
+    memory_usage& parser = report.usage[MEMORY_PARSER];
+    count_vector(parser, tokens.route_stops);
+    count_vector(parser, tokens.stops);
+    count_vector(parser, tokens.routes);
+    count_vector(parser, tokens.stop_ids);
+    count_vector(parser, tokens.visited_stops.words);
+    parser.bytes += LINE_ARENA_SIZE;
+    parser.blocks++;
+}
+
+/**
+ *  Counts the memory of the staged routes, kept between their flushes.
+ */
+void count_staged_memory(memory_report& report, const route_batch& staged) {
+    memory_usage& parser = report.usage[MEMORY_PARSER];
+    count_vector(parser, staged.stops);
+    count_vector(parser, staged.ends);
+}
+
+/**
+ *  Counts the buffers of the output streams.
+ */
+void count_outputs_memory(memory_report& report, const output_streams& outputs) {
+    count_string(report.usage[MEMORY_OUTPUTS], outputs.out.buffer);
+    count_string(report.usage[MEMORY_OUTPUTS], outputs.err.buffer);
+}
+
+/**
+ *  Writes the report, one "name value" line each: the bytes and blocks
+ *  of every structure, their totals and, if KASA_TRACK_MEMORY is set,
+ *  the bytes and blocks held on the heap by the whole process.
+ */
+void write_memory_report(output_sink& sink, const memory_report& report) {
+    memory_usage total;
+
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        const memory_usage& usage = report.usage[i];
+        total.bytes += usage.bytes;
+        total.blocks += usage.blocks;
+
+        for (auto& value : {std::make_pair("_bytes ", usage.bytes), std::make_pair("_blocks ", usage.blocks)}) {
+            write_output(sink, "memory_");
+            write_output(sink, MEMORY_NAMES[i]);
+            write_output(sink, value.first);
+            write_output(sink, (long long)value.second);
+            write_output(sink, "\n");
+        }
+    }
+
+    std::pair<std::string_view, long long> values[] = {
+        {"memory_total_bytes ", (long long)total.bytes},
+        {"memory_total_blocks ", (long long)total.blocks},
+#if KASA_TRACK_MEMORY
+        {"memory_heap_bytes ", (long long)heap_bytes.load()},
+        {"memory_heap_blocks ", (long long)heap_blocks.load()},
+        {"memory_heap_peak_bytes ", (long long)heap_peak_bytes.load()},
+#endif
+    };
+    for (auto& value : values) {
+        write_output(sink, value.first);
+        write_output(sink, value.second);
+        write_output(sink, "\n");
+    }
+}
+
+//Input part
+
+// Size of the blocks in which input that cannot be mapped is read.
+const size_t INPUT_BLOCK_SIZE = 1 << 20;
+
+// Source of input lines. A regular file is mapped into memory as
+// a whole; other inputs (e.g. pipes) are read in large blocks into
+// 'buffer', of which [begin, end) is not consumed yet. Either way lines
+// are handed out as views, valid until the next call to 'read_line'.
+struct input_reader {
+    int fd;
+    const char* mapped = nullptr;
+    size_t mapped_size = 0;
+    size_t mapped_pos = 0;
+
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+};
+
+/**
+ *  Prepares reading lines from the file descriptor.
+ */
+void open_input(input_reader& reader, int fd) {
+    reader.fd = fd;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+            reader.mapped = static_cast<const char*>(map);
+            reader.mapped_size = info.st_size;
+            return;
+        }
+    }
+
+    reader.buffer.resize(INPUT_BLOCK_SIZE);
+}
+
+/**
+ *  Releases the memory mapping of the input, if any.
+ */
+void close_input(input_reader& reader) {
+    if (reader.mapped != nullptr)
+        munmap(const_cast<char*>(reader.mapped), reader.mapped_size);
+    reader.mapped = nullptr;
+}
+
+/**
+ *  Reads the next block of input into the buffer, after the part
+ *  that is not consumed yet (which is moved to the front).
+ *
+ * @return  False at the end of input.
+ */
+bool fill_input(input_reader& reader) {
+    std::vector<char>& buffer = reader.buffer;
+
+    if (reader.begin > 0) {
+        std::copy(buffer.begin() + reader.begin, buffer.begin() + reader.end, buffer.begin());
+        reader.end -= reader.begin;
+        reader.begin = 0;
+    }
+    if (reader.end == buffer.size())
+        buffer.resize(2 * buffer.size());   // A line longer than the buffer.
+
+    while (true) {
+        ssize_t count = read(reader.fd, buffer.data() + reader.end, buffer.size() - reader.end);
+        if (count > 0) {
+            reader.end += count;
+            return true;
+        }
+        if (count < 0 && errno == EINTR)
+            continue;
+
+        reader.eof = true;
+        return false;
+    }
+}
+
+/**
+ *  Reads the next line of input, without the newline character.
+ *
+ * @return  False if there are no more lines.
+ */
+bool read_line(input_reader& reader, std::string_view& line) {
+    if (reader.mapped != nullptr) {
+        if (reader.mapped_pos >= reader.mapped_size)
+            return false;
+
+        const char* start = reader.mapped + reader.mapped_pos;
+        size_t left = reader.mapped_size - reader.mapped_pos;
+        const char* newline = static_cast<const char*>(memchr(start, '\n', left));
+        size_t length = newline != nullptr ? newline - start : left;
+
+        line = std::string_view(start, length);
+        reader.mapped_pos += length + 1;
+        return true;
+    }
+
+    size_t searched = reader.begin;
+    while (true) {
+        const char* start = reader.buffer.data() + reader.begin;
+        const char* newline = static_cast<const char*>(
+            memchr(reader.buffer.data() + searched, '\n', reader.end - searched));
+
+        if (newline != nullptr) {
+            line = std::string_view(start, newline - start);
+            reader.begin += line.size() + 1;
+            return true;
+        }
+
+        size_t pending = reader.end - reader.begin;
+        if (reader.eof || !fill_input(reader)) {
+            // The last line may lack the newline character.
+            if (reader.begin == reader.end)
+                return false;
+            line = std::string_view(reader.buffer.data() + reader.begin, reader.end - reader.begin);
+            reader.begin = reader.end;
+            return true;
+        }
+        searched = reader.begin + pending;
+    }
+}
+
+/**
+ *  Processes all lines of the input, as described in
+ *  'process_line', and writes out the buffered outputs.
+ *
+ * @param report            If not null, the memory of the temporaries
+ *                          is counted into it before they are freed.
+ *
+ * @return  The number of tickets sold.
+ */
+int process_input(input_reader& input, routes_data& r_data, tickets_data& t_data,
+                  output_streams& outputs, memory_report* report = nullptr) {
+    std::string_view line;
+    int line_num = 0;
+
+    line_tokens tokens;
+    route_batch staged;
+    int tickets_sold = 0;
+
+    while (read_line(input, line)) {
+        if (line.size() != 0)
+            process_line(r_data, t_data, tickets_sold, tokens, staged, outputs, line, line_num);
+
+        line_num++;
+    }
+
+    flush_route_batch(r_data.schedule, staged);
+    flush_output(outputs.out);
+    flush_output(outputs.err);
+
+    if (report != nullptr) {
+        count_tokens_memory(*report, tokens);
+        count_staged_memory(*report, staged);
+    }
+    return tickets_sold;
+}
+
+//Source files part
+
+// A file holding lines of a single kind (new routes or new tickets),
+// loaded before the main input, see 'load_source_files'. The errors
+// found in it are collected in 'err' until the file is loaded.
+struct source_file {
+    std::string path;
+    output_sink err = {-1, SIZE_MAX, std::string(), nullptr};
+
+    // The value of errno if the file could not be opened, 0 otherwise.
+    int error = 0;
+};
+
+/**
+ *  Reads the nonempty lines of a source file and passes each one,
+ *  with its number (from 1), to 'process'.
+ */
+template <typename Process>
+void read_source_file(source_file& source, Process process) {
+    int fd = open(source.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        source.error = errno;
+        return;
+    }
+
+    input_reader input;
+    open_input(input, fd);
+
+    std::string_view line;
+    int line_num = 0;
+    while (read_line(input, line)) {
+        line_num++;
+        if (line.size() != 0)
+            process(line, line_num);
+    }
+
+    close_input(input);
+    close(fd);
+}
+
+/**
+ *  Loads a source file of new routes, staged and added at the end;
+ *  lines of other kinds are invalid.
+ */
+void load_routes_file(source_file& source, routes_data& r_data, int threads) {
+    line_tokens tokens;
+    route_batch staged;
+    staged.threads = threads;
+
+    read_source_file(source, [&](std::string_view line, int line_num) {
+        KASA_SAMPLE_LINE();
+        stage_timer timer(STAGE_LINE);
+        bool err;
+
+        if (lex_new_route(line, tokens))
+            err = !parse_and_run_new_route(r_data, tokens, &staged);
+        else {
+            KASA_COUNT(REJECT_SYNTAX);
+            err = true;
+        }
+
+        if (err)
+            report_error(source.err, line, line_num, source.path);
+        release_line_arena(tokens);
+    });
+
+    flush_route_batch(r_data.schedule, staged);
+}
+
+/**
+ *  Loads a source file of new tickets and of ticket updates and removals;
+ *  lines of other kinds are invalid.
+ */
+void load_tickets_file(source_file& source, tickets_data& t_data) {
+    line_tokens tokens;
+
+    read_source_file(source, [&](std::string_view line, int line_num) {
+        KASA_SAMPLE_LINE();
+        stage_timer timer(STAGE_LINE);
+
+        bool err = false;
+        if (lex_new_ticket(line, tokens))
+            err = !parse_and_run_new_ticket(t_data, tokens);
+        else if (!process_ticket_change_line(t_data, tokens, line, err)) {
+            KASA_COUNT(REJECT_SYNTAX);
+            err = true;
+        }
+        if (err)
+            report_error(source.err, line, line_num, source.path);
+    });
+}
+
+/**
+ *  Loads the source files of new routes and of new tickets, of which
+ *  either may be absent (if its path is empty). They fill independent
+ *  structures, so they are parsed at the same time, the routes by
+ *  a thread of its own, which builds their timetables on up to
+ *  'threads' threads. The errors found in them are written out
+ *  afterwards, those of the routes first.
+ *
+ * @return  False if a file could not be opened.
+ */
+bool load_source_files(source_file& routes, source_file& tickets, routes_data& r_data,
+                       tickets_data& t_data, output_streams& outputs, int threads) {
+    std::thread routes_loader;
+    if (!routes.path.empty())
+        routes_loader = std::thread(load_routes_file, std::ref(routes), std::ref(r_data), threads);
+
+    if (!tickets.path.empty())
+        load_tickets_file(tickets, t_data);
+    if (routes_loader.joinable())
+        routes_loader.join();
+
+    write_output(outputs.err, routes.err.buffer);
+    write_output(outputs.err, tickets.err.buffer);
+    return routes.error == 0 && tickets.error == 0;
+}
+
+//Snapshot file part
+
+// Identifies snapshot files; the last byte is the version of the format.
+const char SNAPSHOT_MAGIC[8] = {'K', 'A', 'S', 'A', 'S', 'N', 'P', 4};
+
+// Header of a snapshot file, followed by a payload of 'payload_size' bytes.
+// The payload is made of sections following one another:
+//  - stops: stop_count + 1 offsets of the names (uint32_t), then the names;
+//  - routes: a snapshot_route per route, then the stops of all routes
+//    (route_stop); their indexes are rebuilt when loading;
+//  - tickets: ticket_count + 1 offsets of the names (uint32_t), then
+//    expiration times (int32_t, 0 for a removed ticket), then prices
+//    (int32_t, in cents), then the names;
+//  - the layers of best prices, then the layers of ticket ids.
+// Numbers are stored in the byte order of the machine and without
+// alignment; they are copied out of the file when it is loaded.
+struct snapshot_header {
+    char magic[8];
+    uint32_t max_tickets;
+    uint32_t max_length;
+    uint32_t stop_count;
+    uint32_t route_count;
+    uint32_t ticket_count;
+    uint32_t reserved;
+    uint64_t payload_size;
+    uint64_t checksum;
+};
+
+// Description of a route in a snapshot file, in the order of timetables.
+struct snapshot_route {
+    int32_t number;
+    uint32_t stop_count;
+};
+
+// Position in the payload of a snapshot file being loaded.
+struct snapshot_cursor {
+    const char* data;
+    size_t size;
+    size_t pos = 0;
+    bool valid = true;
+};
+
+/**
+ *  Computes the checksum of a snapshot payload:
+ *  FNV-1a over 64-bit words, then over the remaining bytes.
+ */
+uint64_t snapshot_checksum(const char* data, size_t size) {
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash = 14695981039346656037ull;
+    size_t pos = 0;
+
+    for (; pos + 8 <= size; pos += 8) {
+        uint64_t word;
+        memcpy(&word, data + pos, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; pos < size; pos++)
+        hash = (hash ^ (unsigned char)data[pos]) * prime;
+
+    return hash;
+}
+
+/**
+ *  Appends 'count' values to the payload.
+ */
+template <typename T>
+void append_snapshot_array(std::string& payload, const T* values, size_t count) {
+    payload.append((const char*)values, count * sizeof(T));
+}
+
+/**
+ *  Appends the offsets of the names to the payload, for names
+ *  that will be appended one after another.
+ */
+template <typename Names, typename Name>
+void append_snapshot_names(std::string& payload, const Names& names, Name name_of) {
+    uint32_t offset = 0;
+    append_snapshot_array(payload, &offset, 1);
+    for (const auto& entry : names) {
+        offset += name_of(entry).size();
+        append_snapshot_array(payload, &offset, 1);
+    }
+}
+
+/**
+ *  Takes 'count' bytes from the payload, used in place.
+ *
+ * @return  The bytes, or nullptr if the payload is too short.
+ */
+const char* take_snapshot_bytes(snapshot_cursor& cursor, size_t count) {
+    if (!cursor.valid || count > cursor.size - cursor.pos) {
+        cursor.valid = false;
+        return nullptr;
+    }
+
+    const char* bytes = cursor.data + cursor.pos;
+    cursor.pos += count;
+    return bytes;
+}
+
+/**
+ *  Takes 'count' values from the payload, copied to 'values'
+ *  as they may be unaligned.
+ *
+ * @return  False if the payload is too short.
+ */
+template <typename T, typename Allocator>
+bool take_snapshot_array(snapshot_cursor& cursor, size_t count, std::vector<T, Allocator>& values) {
+    if (!cursor.valid || count > (cursor.size - cursor.pos) / sizeof(T)) {
+        cursor.valid = false;
+        return false;
+    }
+
+    values.resize(count);
+    memcpy(values.data(), take_snapshot_bytes(cursor, count * sizeof(T)), count * sizeof(T));
+    return true;
+}
+
+/**
+ *  Takes 'count' names from the payload.
+ *
+ * @return  The views of the names, empty if the payload is invalid.
+ */
+std::vector<std::string_view> take_snapshot_names(snapshot_cursor& cursor, uint32_t count,
+                                                  const char*& chars) {
+    std::vector<std::string_view> names;
+    std::vector<uint32_t> offsets;
+    if (!take_snapshot_array(cursor, (size_t)count + 1, offsets) || offsets[0] != 0) {
+        cursor.valid = false;
+        return names;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        if (offsets[i + 1] < offsets[i]) {
+            cursor.valid = false;
+            return names;
+        }
+
+    chars = take_snapshot_bytes(cursor, offsets[count]);
+    if (chars == nullptr)
+        return names;
+
+    names.reserve(count);
+    for (uint32_t i = 0; i < count; i++)
+        names.emplace_back(chars + offsets[i], offsets[i + 1] - offsets[i]);
+    return names;
+}
+
+/**
+ *  Saves the routes and the tickets, with the computed table of
+ *  best prices, to a snapshot file. The file is replaced atomically.
+ *
+ * @return  False if the file could not be written (errno tells why).
+ */
+bool save_snapshot_file(const std::string& path, const routes_data& r_data,
+                        const tickets_data& t_data) {
+    const bus_schedule& schedule = r_data.schedule;
+    std::string payload;
+
+    // Stops.
+    append_snapshot_names(payload, r_data.stops.names,
+                          [](const std::string& name) -> std::string_view { return name; });
+    for (const auto& name : r_data.stops.names)
+        payload.append(name);
+
+    // Routes.
+    std::vector<int32_t> numbers(schedule.timetables.size());
+    for (const auto& route : schedule.route_ids)
+        numbers[route.second] = route.first;
+
+    for (size_t i = 0; i < schedule.timetables.size(); i++) {
+        const route_timetable& timetable = schedule.timetables[i];
+        snapshot_route route = {numbers[i], (uint32_t)timetable.stops.size()};
+        append_snapshot_array(payload, &route, 1);
+    }
+    for (const auto& timetable : schedule.timetables)
+        append_snapshot_array(payload, timetable.stops.data(), timetable.stops.size());
+
+    // Tickets.
+    append_snapshot_names(payload, t_data.tickets,
+                          [](const ticket_info& ticket) -> std::string_view { return ticket.first; });
+    for (const auto& ticket : t_data.tickets) {
+        int32_t expiration_time = ticket.second;
+        append_snapshot_array(payload, &expiration_time, 1);
+    }
+    for (const cents price : t_data.ticket_prices)
+        append_snapshot_array(payload, &price.value, 1);
+    for (const auto& ticket : t_data.tickets)
+        payload.append(ticket.first);
+
+    // Table of best prices.
+    append_snapshot_array(payload, t_data.prices.data(), t_data.prices.size());
+    append_snapshot_array(payload, t_data.ids.data(), t_data.ids.size());
+
+    snapshot_header header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.max_tickets = t_data.max_tickets();
+    header.max_length = t_data.max_length();
+    header.stop_count = r_data.stops.names.size();
+    header.route_count = schedule.timetables.size();
+    header.ticket_count = t_data.tickets.size();
+    header.payload_size = payload.size();
+    header.checksum = snapshot_checksum(payload.data(), payload.size());
+
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    output_sink file;
+    file.fd = fd;
+    write_output(file, std::string_view((const char*)&header, sizeof(header)));
+    write_output(file, payload);
+    flush_output(file);
+
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0 && (size_t)info.st_size == sizeof(header) + payload.size() &&
+              fsync(fd) == 0;
+    ok &= close(fd) == 0;
+
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        int error = errno != 0 ? errno : EIO;
+        unlink(temporary.c_str());
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Loads the routes and the tickets from the payload of a snapshot file.
+ *
+ * @return  False if the payload is invalid.
+ */
+bool load_snapshot_payload(snapshot_cursor& cursor, const snapshot_header& header,
+                           routes_data& r_data, tickets_data& t_data) {
+    const char* chars = nullptr;
+
+    // Stops.
+    std::vector<std::string_view> stop_names = take_snapshot_names(cursor, header.stop_count, chars);
+    if (!cursor.valid)
+        return false;
+
+    r_data.stops.ids.reserve(stop_names.size());
+    for (stop_id id = 0; id < stop_names.size(); id++) {
+        r_data.stops.names.emplace_back(stop_names[id]);
+        if (!r_data.stops.ids.emplace(r_data.stops.names.back(), id).second)
+            return false;
+    }
+
+    // Routes.
+    bus_schedule& schedule = r_data.schedule;
+    std::vector<snapshot_route> routes;
+    if (!take_snapshot_array(cursor, header.route_count, routes))
+        return false;
+
+    // Each route is checked the way a route line is.
+    stop_set visited_stops;
+    schedule.timetables.resize(header.route_count);
+    schedule.route_ids.reserve(header.route_count);
+    for (uint32_t i = 0; i < header.route_count; i++) {
+        if (!schedule.route_ids.emplace(routes[i].number, i).second || routes[i].stop_count == 0)
+            return false;
+
+        std::vector<route_stop>& stops = schedule.timetables[i].stops;
+        if (!take_snapshot_array(cursor, routes[i].stop_count, stops))
+            return false;
+
+        uint32_t checked = 0;
+        for (int last_time = FIRST_ARRIVAL - 1; checked < routes[i].stop_count; checked++) {
+            const route_stop& stop = stops[checked];
+            if (stop.stop >= header.stop_count || stop.time <= last_time ||
+                stop.time > LAST_ARRIVAL || !insert_stop(visited_stops, stop.stop))
+                break;
+            last_time = stop.time;
+        }
+        for (uint32_t j = 0; j < checked; j++)
+            erase_stop(visited_stops, stops[j].stop);
+        if (checked != routes[i].stop_count)
+            return false;
+
+        index_timetable(schedule.timetables[i]);
+    }
+
+    // Tickets.
+    std::vector<uint32_t> offsets;
+    std::vector<int32_t> expiration_times, prices;
+    if (!take_snapshot_array(cursor, (size_t)header.ticket_count + 1, offsets) ||
+        !take_snapshot_array(cursor, header.ticket_count, expiration_times) ||
+        !take_snapshot_array(cursor, header.ticket_count, prices) || offsets[0] != 0)
+        return false;
+    for (uint32_t i = 0; i < header.ticket_count; i++)
+        if (offsets[i + 1] < offsets[i] || expiration_times[i] < 0 ||
+            expiration_times[i] > t_data.max_length() || prices[i] < 0)
+            return false;
+
+    chars = take_snapshot_bytes(cursor, offsets[header.ticket_count]);
+    if (chars == nullptr)
+        return false;
+
+    t_data.tickets.reserve(header.ticket_count);
+    t_data.ticket_prices.reserve(header.ticket_count);
+    t_data.bucket_first.assign(t_data.max_length() + 1, -1);
+    t_data.bucket_next.assign(header.ticket_count, -1);
+    for (uint32_t i = 0; i < header.ticket_count; i++) {
+        std::string_view name(chars + offsets[i], offsets[i + 1] - offsets[i]);
+        t_data.tickets.emplace_back(std::string(name), expiration_times[i]);
+        t_data.ticket_prices.push_back(cents{prices[i]});
+        if (expiration_times[i] == 0)
+            continue;   // Removed tickets keep only their IDs.
+
+        if (find_ticket(t_data, name) >= 0)
+            return false;
+        index_ticket(t_data);
+        bucket_ticket(t_data, i);
+    }
+
+    // Table of best prices.
+    size_t table_size = (size_t)t_data.max_tickets() * t_data.stride();
+    if (!take_snapshot_array(cursor, table_size, t_data.prices) ||
+        !take_snapshot_array(cursor, table_size, t_data.ids) || cursor.pos != cursor.size)
+        return false;
+
+    for (size_t i = 0; i < table_size; i++) {
+        int id = t_data.ids[i];
+        if (t_data.prices[i] < 0 || id < -1 || id >= (int)header.ticket_count ||
+            (id >= 0 && expiration_times[id] == 0))
+            return false;
+    }
+    return true;
+}
+
+/**
+ *  Replaces the routes and the tickets with the ones saved in
+ *  a snapshot file. The file is mapped and read in one pass: the table
+ *  of best prices is copied as it is, the indexes of the routes and
+ *  the tickets are rebuilt. The bounds of the ticket data must be
+ *  the ones the file was saved with.
+ *
+ * @return  False if the file could not be loaded, with the reason
+ *          in 'error'; the data is left unchanged then.
+ */
+bool load_snapshot_file(const std::string& path, routes_data& r_data, tickets_data& t_data,
+                        std::string& error) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        error = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t size = info.st_size;
+    void* mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (size < sizeof(snapshot_header) || mapped == MAP_FAILED) {
+        error = size < sizeof(snapshot_header) ? "not a snapshot file" : strerror(errno);
+        if (mapped != MAP_FAILED)
+            munmap(mapped, size);
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    const char* data = (const char*)mapped;
+    snapshot_header header;
+    memcpy(&header, data, sizeof(header));
+
+    routes_data loaded_routes;
+    loaded_routes.schedule.version = r_data.schedule.version + 1;
+    tickets_data loaded_tickets;
+    loaded_tickets.tickets_limit = t_data.tickets_limit;
+    loaded_tickets.length_limit = t_data.length_limit;
+    loaded_tickets.version = t_data.version + 1;
+
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+        error = "not a snapshot file of this version";
+    else if (header.max_tickets != (uint32_t)t_data.max_tickets() ||
+             header.max_length != (uint32_t)t_data.max_length())
+        error = "saved with other ticket bounds";
+    else if (header.payload_size != size - sizeof(header) ||
+             header.checksum != snapshot_checksum(data + sizeof(header), header.payload_size))
+        error = "corrupted";
+    else {
+        snapshot_cursor cursor = {data + sizeof(header), header.payload_size};
+        if (!load_snapshot_payload(cursor, header, loaded_routes, loaded_tickets))
+            error = "invalid contents";
+    }
+
+    munmap(mapped, size);
+    if (!error.empty())
+        return false;
+
+    r_data = std::move(loaded_routes);
+    t_data = std::move(loaded_tickets);
+    return true;
+}
+
+//Parallel part
+
+// Maximal number of lines of a query_run.
+const size_t QUERY_RUN_LINES = 1 << 16;
+
+// Query runs shorter than this are executed by the reading thread alone.
+const size_t MIN_PARALLEL_RUN = 1024;
+
+// A run of consecutive lines that do not modify the data (see
+// 'process_query_line'), copied out of the input. A line is given
+// as a pair <offset, length> into 'text', with its number.
+struct query_run {
+    std::string text;
+    std::vector<std::pair<size_t, size_t> > lines;
+    std::vector<int> line_nums;
+};
+
+// State of a thread executing a part of a query run. Its outputs are
+// only buffered in memory; out_ends[i] and err_ends[i] are the sizes
+// of the buffers after the i-th line of the part.
+struct query_worker {
+    line_tokens tokens;
+    output_streams outputs;
+    std::vector<size_t> out_ends;
+    std::vector<size_t> err_ends;
+    int tickets_sold = 0;
+};
+
+// Pool of threads executing parts of query runs. Every time 'generation'
+// is increased, thread i runs 'task(i)'; thread 0 is the reading thread,
+// which is not a member of 'threads'.
+struct worker_pool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    std::function<void(int)> task;
+    unsigned generation = 0;
+    int running = 0;
+    bool stopping = false;
+};
+
+/**
+ *  Main loop of a pool thread.
+ */
+void run_worker(worker_pool& pool, int id) {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    while (true) {
+        pool.started.wait(lock, [&] { return pool.stopping || pool.generation != seen; });
+        if (pool.stopping)
+            return;
+        seen = pool.generation;
+
+        lock.unlock();
+        pool.task(id);
+        lock.lock();
+
+        if (--pool.running == 0)
+            pool.finished.notify_one();
+    }
+}
+
+/**
+ *  Starts the pool threads, so that tasks run on 'count' threads
+ *  including the calling one.
+ */
+void start_workers(worker_pool& pool, int count) {
+    for (int id = 1; id < count; id++)
+        pool.threads.emplace_back(run_worker, std::ref(pool), id);
+}
+
+/**
+ *  Stops and joins the pool threads.
+ */
+void stop_workers(worker_pool& pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.started.notify_all();
+
+    for (auto& thread : pool.threads)
+        thread.join();
+    pool.threads.clear();
+}
+
+/**
+ *  Runs the task on all threads of the pool and the calling thread
+ *  (as number 0), and waits until they all finish.
+ */
+void run_on_workers(worker_pool& pool, const std::function<void(int)>& task) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.task = task;
+        pool.running = pool.threads.size();
+        pool.generation++;
+    }
+    pool.started.notify_all();
+
+    task(0);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.finished.wait(lock, [&] { return pool.running == 0; });
+}
+
+/**
+ *  Prepares outputs that are only buffered in memory.
+ */
+void open_memory_outputs(output_streams& outputs) {
+    for (output_sink* sink : {&outputs.out, &outputs.err}) {
+        sink->fd = -1;
+        sink->flush_size = SIZE_MAX;
+        sink->merged = nullptr;
+    }
+}
+
+/**
+ *  Executes a query run, splitting it between the workers, and writes
+ *  the outputs of its lines to 'outputs' in the order of input.
+ *  The data is not modified while the run is executed, so the workers
+ *  share it. New routes staged before the run are added first.
+ */
+void execute_query_run(query_run& run, routes_data& r_data, tickets_data& t_data,
+                       route_batch& staged, std::vector<query_worker>& workers,
+                       worker_pool& pool, output_streams& outputs, int& tickets_sold) {
+    flush_route_batch(r_data.schedule, staged);
+
+    size_t parts = run.lines.size() < MIN_PARALLEL_RUN ? 1 : workers.size();
+
+    auto task = [&](int id) {
+        query_worker& worker = workers[id];
+        worker.outputs.out.buffer.clear();
+        worker.outputs.err.buffer.clear();
+        worker.out_ends.clear();
+        worker.err_ends.clear();
+
+        for (size_t i = run.lines.size() * id / parts; i < run.lines.size() * (id + 1) / parts; i++) {
+            std::string_view line(run.text.data() + run.lines[i].first, run.lines[i].second);
+            KASA_SAMPLE_LINE();
+            stage_timer timer(STAGE_LINE);
+            process_query_line(r_data, t_data, worker.tickets_sold, worker.tokens,
+                               worker.outputs, line, run.line_nums[i]);
+
+            worker.out_ends.push_back(worker.outputs.out.buffer.size());
+            worker.err_ends.push_back(worker.outputs.err.buffer.size());
+        }
+    };
+
+    if (parts == 1) {
+        task(0);
+    }
+    else {
+        render_ticket_set_replies(t_data);
+        run_on_workers(pool, task);
+    }
+
+    // Emits the outputs, line by line to keep the order of the streams.
+    for (size_t id = 0; id < parts; id++) {
+        query_worker& worker = workers[id];
+        size_t out_begin = 0, err_begin = 0;
+
+        for (size_t i = 0; i < worker.out_ends.size(); i++) {
+            std::string_view out = worker.outputs.out.buffer;
+            std::string_view err = worker.outputs.err.buffer;
+
+            if (worker.out_ends[i] > out_begin)
+                write_output(outputs.out, out.substr(out_begin, worker.out_ends[i] - out_begin));
+            if (worker.err_ends[i] > err_begin)
+                write_output(outputs.err, err.substr(err_begin, worker.err_ends[i] - err_begin));
+
+            out_begin = worker.out_ends[i];
+            err_begin = worker.err_ends[i];
+        }
+
+        tickets_sold += worker.tickets_sold;
+        worker.tickets_sold = 0;
+    }
+
+    run.text.clear();
+    run.lines.clear();
+    run.line_nums.clear();
+}
+
+/**
+ *  Counts the memory of a query run and of the workers executing it.
+ */
+void count_workers_memory(memory_report& report, const query_run& run,
+                          const std::vector<query_worker>& workers) {
+    memory_usage& parser = report.usage[MEMORY_PARSER];
+    count_string(parser, run.text);
+    count_vector(parser, run.lines);
+    count_vector(parser, run.line_nums);
+
+    for (auto& worker : workers) {
+        count_tokens_memory(report, worker.tokens);
+        count_outputs_memory(report, worker.outputs);
+        count_vector(report.usage[MEMORY_OUTPUTS], worker.out_ends);
+        count_vector(report.usage[MEMORY_OUTPUTS], worker.err_ends);
+    }
+}
+
+/**
+ *  Processes all lines of the input like 'process_input', executing
+ *  runs of consecutive lines that do not modify the data on 'threads'
+ *  threads. Lines that may modify the data are processed one by one
+ *  by the reading thread, between the runs.
+ *
+ * @param report            As for 'process_input', the workers included.
+ *
+ * @return  The number of tickets sold.
+ */
+int process_input_parallel(input_reader& input, routes_data& r_data, tickets_data& t_data,
+                           output_streams& outputs, int threads, memory_report* report = nullptr) {
+    std::string_view line;
+    int line_num = 0;
+
+    line_tokens tokens;
+    route_batch staged;
+    staged.threads = threads;
+    int tickets_sold = 0;
+
+    query_run run;
+    worker_pool pool;
+    std::vector<query_worker> workers(threads);
+    for (auto& worker : workers)
+        open_memory_outputs(worker.outputs);
+    start_workers(pool, threads);
+
+    while (read_line(input, line)) {
+        if (line.size() == 0) {
+            line_num++;
+            continue;
+        }
+
+        // Only the lines of other kinds may modify the data.
+        if (classify_line(line) == LINE_QUERY) {
+            run.lines.push_back(std::make_pair(run.text.size(), line.size()));
+            run.line_nums.push_back(line_num);
+            run.text.append(line);
+
+            if (run.lines.size() == QUERY_RUN_LINES)
+                execute_query_run(run, r_data, t_data, staged, workers, pool, outputs, tickets_sold);
+        }
+        else {
+            if (!run.lines.empty())
+                execute_query_run(run, r_data, t_data, staged, workers, pool, outputs, tickets_sold);
+            process_line(r_data, t_data, tickets_sold, tokens, staged, outputs, line, line_num);
+        }
+
+        line_num++;
+    }
+
+    if (!run.lines.empty())
+        execute_query_run(run, r_data, t_data, staged, workers, pool, outputs, tickets_sold);
+    stop_workers(pool);
+
+    flush_route_batch(r_data.schedule, staged);
+    flush_output(outputs.out);
+    flush_output(outputs.err);
+
+    if (report != nullptr) {
+        count_tokens_memory(*report, tokens);
+        count_staged_memory(*report, staged);
+        count_workers_memory(*report, run, workers);
+    }
+    return tickets_sold;
+}
+
+//Snapshot part
+
+// Immutable version of all the data. Parts which did not change
+// between versions are shared by them.
+struct data_snapshot {
+    std::shared_ptr<const routes_data> routes;
+    std::shared_ptr<const tickets_data> tickets;
+};
+
+using snapshot_ptr = std::shared_ptr<const data_snapshot>;
+
+// The latest published version of the data. It is only accessed
+// with 'acquire_snapshot' and 'publish_snapshot', which are atomic.
+struct snapshot_store {
+    snapshot_ptr current;
+};
+
+// The version of the data being built by the (single) writer. A part
+// which was published is copied before it is modified again while
+// readers may hold it, so that they never see a change.
+struct data_writer {
+    std::shared_ptr<routes_data> routes = std::make_shared<routes_data>();
+    std::shared_ptr<tickets_data> tickets = std::make_shared<tickets_data>();
+    bool routes_published = false;
+    bool tickets_published = false;
+};
+
+/**
+ *  Obtains the latest published version of the data. It never blocks;
+ *  the version stays valid (and is freed) until the last reader
+ *  holding it drops it.
+ */
+snapshot_ptr acquire_snapshot(const snapshot_store& store) {
+    return std::atomic_load(&store.current);
+}
+
+/**
+ *  Checks whether a reader may hold a published part of the data: some
+ *  older version shares it, or a reader holds the current version.
+ *  Otherwise only the writer and the current version hold it, and it can
+ *  be modified in place, as readers acquire versions between the changes
+ *  of the writer (on its thread) and it publishes them first.
+ */
+template <typename T>
+bool is_read_part(const std::shared_ptr<T>& part, const snapshot_store& store) {
+    return part.use_count() > 2 || store.current.use_count() > 1;
+}
+
+/**
+ *  Obtains the route data of the next version, to be modified.
+ */
+routes_data& writable_routes(data_writer& writer, const snapshot_store& store) {
+    if (writer.routes_published && is_read_part(writer.routes, store))
+        writer.routes = std::make_shared<routes_data>(*writer.routes);
+    writer.routes_published = false;
+    return *writer.routes;
+}
+
+/**
+ *  Obtains the ticket data of the next version, to be modified.
+ */
+tickets_data& writable_tickets(data_writer& writer, const snapshot_store& store) {
+    if (writer.tickets_published && is_read_part(writer.tickets, store))
+        writer.tickets = std::make_shared<tickets_data>(*writer.tickets);
+    writer.tickets_published = false;
+    return *writer.tickets;
+}
+
+/**
+ *  Atomically replaces the published version of the data with
+ *  the one built by the writer. The replies of the ticket data are
+ *  rendered first, so that readers never fill in its cache.
+ */
+void publish_snapshot(data_writer& writer, snapshot_store& store) {
+    render_ticket_set_replies(*writer.tickets);
+
+    auto next = std::make_shared<data_snapshot>();
+    next->routes = writer.routes;
+    next->tickets = writer.tickets;
+    writer.routes_published = true;
+    writer.tickets_published = true;
+
+    std::atomic_store(&store.current, snapshot_ptr(std::move(next)));
+}
+
+//Stats report part
+
+// Formats of the dump of the statistics.
+enum stats_format {
+    STATS_NONE,
+    STATS_JSON,
+    STATS_PROMETHEUS,
+};
+
+// Quantiles of the latency histograms in the dump,
+// with their names in JSON and Prometheus.
+struct stats_quantile {
+    std::string_view json_name;
+    std::string_view prometheus_name;
+    double value;
+};
+
+const stats_quantile STATS_QUANTILES[] = {
+    {"p50", "0.5", 0.5}, {"p90", "0.9", 0.9}, {"p99", "0.99", 0.99}, {"p999", "0.999", 0.999},
+};
+
+/**
+ *  Writes the statistics as a JSON object (on a single line).
+ */
+void write_stats_json(output_sink& sink, const thread_stats& stats) {
+    write_output(sink, "{\"counters\":{");
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        write_output(sink, i > 0 ? ",\"" : "\"");
+        write_output(sink, COUNTER_NAMES[i]);
+        write_output(sink, "\":");
+        write_output(sink, (long long)stats.counters[i]);
+    }
+
+    write_output(sink, "},\"stages_ns\":{");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const latency_histogram& histogram = stats.stages[i];
+        write_output(sink, i > 0 ? ",\"" : "\"");
+        write_output(sink, STAGE_NAMES[i]);
+        write_output(sink, "\":{\"samples\":");
+        write_output(sink, (long long)histogram.samples);
+        write_output(sink, ",\"mean\":");
+        write_output(sink, (long long)(histogram.samples > 0 ? histogram.sum / histogram.samples : 0));
+        for (auto& quantile : STATS_QUANTILES) {
+            write_output(sink, ",\"");
+            write_output(sink, quantile.json_name);
+            write_output(sink, "\":");
+            write_output(sink, (long long)histogram_quantile(histogram, quantile.value));
+        }
+        write_output(sink, ",\"max\":");
+        write_output(sink, (long long)histogram.max);
+        write_output(sink, "}");
+    }
+    write_output(sink, "}}\n");
+}
+
+/**
+ *  Writes the statistics in the Prometheus text exposition format,
+ *  with the latencies as summaries.
+ */
+void write_stats_prometheus(output_sink& sink, const thread_stats& stats) {
+    write_output(sink, "# TYPE kasa_events_total counter\n");
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        write_output(sink, "kasa_events_total{event=\"");
+        write_output(sink, COUNTER_NAMES[i]);
+        write_output(sink, "\"} ");
+        write_output(sink, (long long)stats.counters[i]);
+        write_output(sink, "\n");
+    }
+
+    write_output(sink, "# TYPE kasa_stage_latency_nanoseconds summary\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const latency_histogram& histogram = stats.stages[i];
+        std::string_view stage = STAGE_NAMES[i];
+
+        for (auto& quantile : STATS_QUANTILES) {
+            write_output(sink, "kasa_stage_latency_nanoseconds{stage=\"");
+            write_output(sink, stage);
+            write_output(sink, "\",quantile=\"");
+            write_output(sink, quantile.prometheus_name);
+            write_output(sink, "\"} ");
+            write_output(sink, (long long)histogram_quantile(histogram, quantile.value));
+            write_output(sink, "\n");
+        }
+        for (auto& total : {std::make_pair("_sum", histogram.sum), std::make_pair("_count", histogram.samples)}) {
+            write_output(sink, "kasa_stage_latency_nanoseconds");
+            write_output(sink, total.first);
+            write_output(sink, "{stage=\"");
+            write_output(sink, stage);
+            write_output(sink, "\"} ");
+            write_output(sink, (long long)total.second);
+            write_output(sink, "\n");
+        }
+    }
+}
+
+/**
+ *  Writes the statistics gathered so far by all threads.
+ */
+void write_stats_report(output_sink& sink, stats_format format) {
+    thread_stats stats = collect_stats();
+
+    if (format == STATS_JSON)
+        write_stats_json(sink, stats);
+    else if (format == STATS_PROMETHEUS)
+        write_stats_prometheus(sink, stats);
+}
+
+//Server part
+
+// First byte of a binary frame; no line of the text grammar starts with it.
+const unsigned char FRAME_MAGIC = 0xB5;
+
+// A frame consists of FRAME_MAGIC, its kind and the length of its
+// payload (4 bytes, little endian), followed by the payload.
+const size_t FRAME_HEADER_SIZE = 6;
+
+// Longest accepted request (a line or the payload of a frame). A longer
+// one closes the connection.
+const size_t MAX_REQUEST_SIZE = 1 << 20;
+
+// Number of bytes of replies pending on a connection above which
+// no more requests are read from it.
+const size_t MAX_PENDING_REPLIES = 1 << 20;
+
+// Kinds of frames. The payload of a FRAME_LINE request is a line of
+// the text grammar, and that of its reply is the output for the line
+// (empty if there is none). A FRAME_STATS request has no payload and
+// its reply contains the statistics.
+enum frame_kind : unsigned char {
+    FRAME_LINE = 1,
+    FRAME_STATS = 2,
+};
+
+// Line of the text protocol requesting the statistics.
+const std::string_view STATS_REQUEST = "#stats";
+
+// Line of the text protocol requesting the memory report.
+const std::string_view MEMORY_REQUEST = "#memory";
+
+// Statistics of the server, including the tickets sold while loading.
+struct server_stats {
+    long long tickets_sold = 0;
+    long long requests = 0;
+    long long connections = 0;
+    long long open_connections = 0;
+};
+
+// A client of the server. Requests are processed in the order they arrive,
+// as soon as they are complete, and replies are sent in the same order.
+struct connection {
+    int fd;
+    std::string received;
+    std::string pending;
+    int line_num = 0;
+    uint32_t events = 0;
+
+    // Whether the client finished sending requests.
+    bool finished = false;
+};
+
+// State of the server. Routes and tickets are modified through 'writer',
+// trip requests read the latest version published to 'store'.
+struct server_state {
+    int epoll_fd = -1;
+    int listen_fd = -1;
+    int signal_fd = -1;
+    std::string socket_path;
+
+    data_writer writer;
+    snapshot_store store;
+    bool changed = false;
+
+    line_tokens tokens;
+    output_streams outputs;
+    std::unordered_map<int, connection> connections;
+    server_stats stats;
+
+    // Format of the statistics dumped to the standard error on SIGUSR1.
+    stats_format report_format = STATS_NONE;
+};
 
 /**
- * @short Checks the validity of a request of the first type.
- * 
- * Checks whether given data can constitute a valid request
- * to add a new route to the system. 
- * A valid request must satisfy the following criteria:
- * 1) A route of given number must not already exist in the system;
- * 2) No stop occurs twice on the route;
- * 3) All arrival times are given in an increasing order.
- * 
- * @param   number (unique) of the route to be added
- * @param   a vector of pairs <stop_name, arrival_time> describing the new route
- * @param   the set holding the IDs of all existing bus routes
- * 
- * @return  The result of validity check. 
+ *  Appends a binary frame to the text.
  */
-bool is_valid_new_route(int route_number, const route_info& stops_on_route,
-                        const std::set<int>& existing_routes) 
-{
-    if(existing_routes.count(route_number) > 0)
-        return false;
-        
-    if(stops_on_route.size() == 0) return false;
-    
-    std::unordered_set<std::string> visited_stops;
-    int last_stop_time = 0;
-    
-    for(auto i = stops_on_route.begin(); i != stops_on_route.end(); i++) {
-        visited_stops.insert((*i).first);
-        
-        if((*i).second <= last_stop_time) return false;
-        last_stop_time = (*i).second;
-    }
-    
-    if(visited_stops.size() < stops_on_route.size()) return false;
-    
-    return true;
+void append_frame(std::string& text, frame_kind kind, std::string_view payload) {
+    char header[FRAME_HEADER_SIZE] = {(char)FRAME_MAGIC, (char)kind};
+    uint32_t length = payload.size();
+    for (int i = 0; i < 4; i++)
+        header[2 + i] = length >> (8 * i);
+
+    text.append(header, FRAME_HEADER_SIZE);
+    text.append(payload);
 }
 
 /**
- * @short Creates a new schedule_point object.
- * 
- * Creates a new schedule_point object based on given parameters.
- * 
- * @param   number of a bus route
- * @param   name of a bus stop lying on the route
- * 
- * @return  The created schedule_point. 
+ *  Writes the statistics of the server, one "name value" line each.
  */
-schedule_point create_schedule_point(int route, std::string bus_stop) {
-    return make_pair(bus_stop, route);
+void write_stats(output_sink& sink, const server_stats& stats) {
+    std::pair<std::string_view, long long> values[] = {
+        {"tickets_sold ", stats.tickets_sold},
+        {"requests ", stats.requests},
+        {"connections ", stats.connections},
+        {"open_connections ", stats.open_connections},
+    };
+    for (auto& value : values) {
+        write_output(sink, value.first);
+        write_output(sink, value.second);
+        write_output(sink, "\n");
+    }
 }
 
 /**
- * @short Adds a new route
- * 
- * Fulfils a request to add a new route according to the parameters.
- * 
- * @param   number (unique) of the route to be added
- * @param   a vector of pairs <stop_name, arrival_time> describing the new route  
- * @param   the set holding the IDs of all existing bus routes
- * @param   the structure representing all existing relations of bus stops 
- *          and routes in the form of bus schedule
- * 
- * @return  False if given arguments do not constitute a valid new route 
- *          (in which case nothing is added). Otherwise true.
+ *  Writes the memory report of the server: the data being built, the
+ *  parts of the published version that are not shared with it (as
+ *  snapshots), the tokens and the buffers of the server and its clients.
  */
-bool add_new_route(int route_number, const route_info& stops_on_route, 
-                   std::set<int>& existing_routes, 
-                   bus_schedule& schedule) 
-{
-    if(is_valid_new_route(route_number, stops_on_route, 
-                          existing_routes) == false) return false;
-                          
-    existing_routes.insert(route_number);
-    for(auto i = stops_on_route.begin(); i != stops_on_route.end(); i++) {
-        schedule[create_schedule_point(route_number, (*i).first)] = (*i).second;
+void write_server_memory(output_sink& sink, const server_state& server) {
+    memory_report report;
+    count_routes_memory(report, *server.writer.routes);
+    count_tickets_memory(report, *server.writer.tickets);
+    count_tokens_memory(report, server.tokens);
+    count_outputs_memory(report, server.outputs);
+    for (auto& conn : server.connections) {
+        count_string(report.usage[MEMORY_OUTPUTS], conn.second.received);
+        count_string(report.usage[MEMORY_OUTPUTS], conn.second.pending);
     }
-    return true;
-}
 
-bool contains(const bus_schedule& schedule, schedule_point k){
-    return schedule.count(k) > 0;
+    memory_report published;
+    snapshot_ptr snapshot = acquire_snapshot(server.store);
+    if (snapshot && snapshot->routes != server.writer.routes)
+        count_routes_memory(published, *snapshot->routes);
+    if (snapshot && snapshot->tickets != server.writer.tickets)
+        count_tickets_memory(published, *snapshot->tickets);
+
+    for (auto& usage : published.usage) {
+        report.usage[MEMORY_SNAPSHOTS].bytes += usage.bytes;
+        report.usage[MEMORY_SNAPSHOTS].blocks += usage.blocks;
+    }
+    write_memory_report(sink, report);
 }
 
 /**
- * @short Checks the validity of a request of the third type.
- * 
- * Checks whether given data can constitute a valid request to find the
- * optimal ticket buying strategy.
- * A valid request must satisfy the following criteria:
- * 1) The number of stops given must be equal to the number of connecting
- *    routes given + 1; there need to be at least one connection, 
- *    which constitutes a minimum of two stops and one route.
- * 2) All given routes must exist in the schedule and include respective stops.
- * 3) Given order of stops and routes must imply a non-decreasing order 
- *    of the respective arrival and departure times, according to the schedule.
- * 
- * @param   a vector containing a sequence of stops
- * @param   a vector containing the sequence of routes intended to use 
- *          for travel between the stops
- * @param   the structure representing all existing relations of bus stops 
- *          and routes in the form of bus schedule
- * 
- * @return  The result of validity check. 
+ *  Processes a line of the text grammar, writing its output to
+ *  'server.outputs'. Trip requests are answered from the latest
+ *  version of the data, published first if it has changed.
  */
-bool check_trip_validity (const std::vector<std::string>& stops, 
-                          const std::vector<int>& routes,
-                          const bus_schedule& schedule) 
-{
-    if(stops.size() < 2) return false;
-    if(routes.size() < 1 ) return false;
-    if(stops.size() != routes.size() + 1) return false;
+void serve_line(server_state& server, connection& conn, std::string_view line) {
+    int line_num = conn.line_num++;
+    line_tokens& tokens = server.tokens;
+    bool err = false;
 
-    std::vector<schedule_point> trip_points;
-    
-    auto curr_route = routes.begin();
-    for(auto departing_stop = stops.begin(), target_stop = ++stops.begin();
-        curr_route != routes.end();
-        departing_stop++, target_stop++, curr_route++)
-    {
-        trip_points.push_back(create_schedule_point(*curr_route, 
-                                                    *departing_stop));
-        trip_points.push_back(create_schedule_point(*curr_route, 
-                                                    *target_stop));
+    KASA_SAMPLE_LINE();
+    stage_timer timer(STAGE_LINE);
+
+    server.stats.requests++;
+
+    if (line.size() == 0)
+        return;
+
+    line_kind kind = classify_line(line);
+
+    if (line == STATS_REQUEST) {
+        write_stats(server.outputs.out, server.stats);
     }
-    
-    for(auto i = trip_points.begin(), j = ++trip_points.begin();
-        j != trip_points.end(); 
-        i++, j++)
-    {
-        if(schedule.count(*i) == 0) return false;
-        if(schedule.count(*j) == 0) return false;
-        if(schedule.at(*i) > schedule.at(*j)) return false;
+    else if (line == MEMORY_REQUEST) {
+        write_server_memory(server.outputs.out, server);
     }
-    
-    return true;
-}
-
-/**
- * Performs checks necessary to find the optimal ticket buying strategy
- * for a request of the third type or conclude that it is not possible.
- * Returns the results of the processing as a tuple.
- * 
- * @param   vector of stops to visit in the order of visit
- * @param   vector of routes used to travel between consecutive pairs of stops, in the respective order
- * @param   the structure representing all existing relations of bus stops 
- *          and routes in the form of bus schedule
- * 
- * @return  A tuple containing the result of the checks, whose 
- *          first element denotes the time the entire trip would take,
- *          second element is true if and only if it is required to wait
- *          at least once during the trip, 
- *          third element is equal to the name of the first stop of the trip
- *          where waiting would be required (if the second element is true),
- *          and an empty string otherwise
- */
-std::tuple<int, bool, std::string> 
-    scan_trip_request(const std::vector<std::string>& stops, 
-                      const std::vector<int>& routes, 
-                      const bus_schedule& schedule) 
-{
-    std::vector<schedule_point> departure_points (routes.size());
-    std::transform(routes.begin(), routes.end(), stops.begin(),
-                   departure_points.begin(), create_schedule_point);
-                   
-    std::vector<schedule_point> arrival_points (routes.size());
-    std::transform(routes.begin(), routes.end(), ++stops.begin(),
-                   arrival_points.begin(), create_schedule_point);
-                   
-    int last_time = schedule.at(departure_points.front());
-    bool needs_waiting = false;
-    std::string where_needs_to_wait = "";
-    
-    for(auto i = departure_points.begin(), j = arrival_points.begin();
-        i != departure_points.end(); i++, j++)
-    {
-        if(needs_waiting == false && schedule.at(*i) != last_time) {
-            needs_waiting = true;
-            where_needs_to_wait = (*i).first;
+    else if (kind == LINE_ROUTE && lex_new_route(line, tokens)) {
+        err = !parse_and_run_new_route(writable_routes(server.writer, server.store), tokens);
+        server.changed = true;
+    }
+    else if (kind == LINE_TICKET && lex_new_ticket(line, tokens)) {
+        err = !parse_and_run_new_ticket(writable_tickets(server.writer, server.store), tokens);
+        server.changed = true;
+    }
+    else if (kind == LINE_UPDATE && lex_update_ticket(line, tokens)) {
+        err = !parse_and_run_update_ticket(writable_tickets(server.writer, server.store), tokens);
+        server.changed = true;
+    }
+    else if (kind == LINE_REMOVE && lex_remove_ticket(line, tokens)) {
+        err = !parse_and_run_remove_ticket(writable_tickets(server.writer, server.store), tokens);
+        server.changed = true;
+    }
+    else if (kind != LINE_QUERY) {
+        KASA_COUNT(REJECT_SYNTAX);
+        err = true;
+    }
+    else {
+        if (server.changed) {
+            publish_snapshot(server.writer, server.store);
+            server.changed = false;
         }
-         
-        last_time = schedule.at(*j);
+
+        snapshot_ptr snapshot = acquire_snapshot(server.store);
+        int tickets_sold = 0;
+        process_query_line(*snapshot->routes, *snapshot->tickets, tickets_sold,
+                           tokens, server.outputs, line, line_num);
+        server.stats.tickets_sold += tickets_sold;
     }
-    
-    int travel_time = schedule.at(arrival_points.back()) - 
-                           schedule.at(departure_points.front());
-    
-    return std::make_tuple(travel_time, needs_waiting, where_needs_to_wait);
+
+    if (err)
+        report_error(server.outputs.err, line, line_num + 1);
+
+    release_line_arena(tokens);
 }
 
-// route part
+/**
+ *  Moves the output written to 'server.outputs' to the text.
+ */
+void take_server_output(server_state& server, std::string& text) {
+    text.append(server.outputs.out.buffer);
+    text.append(server.outputs.err.buffer);
+    server.outputs.out.buffer.clear();
+    server.outputs.err.buffer.clear();
+}
 
 /**
- * Provides an answer for a third type request. Writes the result 
- * to standard output, according to the task specification 
- * at https://moodle.mimuw.edu.pl/mod/assign/view.php?id=19131.
- * 
- * @param   vector of stops to visit in the order of visit
- * @param   vector of routes used to travel between consecutive pairs of stops, 
- *          in the respective order
- * @param   the structure representing all existing relations of bus stops 
- *          and routes in the form of bus schedule
+ *  Processes all complete requests received on the connection.
  *
- * @return False if the request was invalid. True otherwise.
+ * @return  False if the client broke the protocol.
  */
-bool plan_tickets(const std::vector<std::string>& stops, 
-                  const std::vector<int>& routes, 
-                  const bus_schedule& schedule,
-                  const tickets_data& t_data,
-                  int& tickets_sold)
-{    
-    if(check_trip_validity(stops, routes, schedule) == false) return false;
-    
-    int trip_time;
-    bool waits;
-    std::string where_waits;
-    std::tie (trip_time, waits, where_waits) = 
-        scan_trip_request(stops, routes, schedule);
-    
-    if(waits == true){
-        std::cout << ":(" << " " << where_waits << std::endl;
-        return true;
-    }
+bool serve_requests(server_state& server, connection& conn) {
+    std::string_view received = conn.received;
+    size_t pos = 0;
+    std::string payload;
 
-    std::vector< std::string > optimal_tickets = optimal_ticket_set(t_data, trip_time + 1);
+    while (pos < received.size()) {
+        if ((unsigned char)received[pos] == FRAME_MAGIC) {
+            if (received.size() - pos < FRAME_HEADER_SIZE)
+                break;
 
-    if(ticket_set_found(optimal_tickets) == false) {
-        std::cout << ":|" << std::endl;
-    }
-    else{
-        tickets_sold += optimal_tickets.size();
+            uint32_t length = 0;
+            for (int i = 0; i < 4; i++)
+                length |= (uint32_t)(unsigned char)received[pos + 2 + i] << (8 * i);
+            if (length > MAX_REQUEST_SIZE)
+                return false;
+            if (received.size() - pos - FRAME_HEADER_SIZE < length)
+                break;
 
-        std::cout << "!" << " " << optimal_tickets.front();
-        
-        for(auto i = ++optimal_tickets.begin(); 
-            i != optimal_tickets.end(); 
-            i++)
-        {
-            std::cout << ";" << " " << (*i);
+            frame_kind kind = (frame_kind)received[pos + 1];
+            std::string_view request = received.substr(pos + FRAME_HEADER_SIZE, length);
+
+            if (kind == FRAME_LINE && request.find('\n') == std::string_view::npos)
+                serve_line(server, conn, request);
+            else if (kind == FRAME_STATS && request.empty())
+                write_stats(server.outputs.out, server.stats);
+            else
+                return false;
+
+            payload.clear();
+            take_server_output(server, payload);
+            append_frame(conn.pending, kind, payload);
+            pos += FRAME_HEADER_SIZE + length;
+        }
+        else {
+            size_t end = received.find('\n', pos);
+            if (end == std::string_view::npos) {
+                if (received.size() - pos > MAX_REQUEST_SIZE)
+                    return false;
+                if (!conn.finished)
+                    break;
+                end = received.size();  // The last line lacks its newline.
+            }
+
+            serve_line(server, conn, received.substr(pos, end - pos));
+            take_server_output(server, conn.pending);
+            pos = std::min(end + 1, received.size());
         }
-        
-        std::cout << std::endl;
     }
+
+    conn.received.erase(0, pos);
     return true;
 }
 
+/**
+ *  Reads the requests available on the connection and processes them.
+ *
+ * @return  False if the connection failed.
+ */
+bool receive_requests(server_state& server, connection& conn) {
+    char block[1 << 16];
 
-//Parser part
+    while (!conn.finished && conn.pending.size() < MAX_PENDING_REPLIES) {
+        ssize_t count = read(conn.fd, block, sizeof(block));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (count < 0)
+            return false;
 
-void report_error(std::string& txt, int line_num) {
-    std::cerr << "Error in line " << line_num << ":" << txt << "\n";
+        if (count == 0)
+            conn.finished = true;
+        else
+            conn.received.append(block, count);
+
+        if (!serve_requests(server, conn))
+            return false;
+    }
+    return true;
 }
 
 /**
- *  Obtains int value from a regex pointer.
+ *  Sends as many pending replies as the connection accepts.
+ *
+ * @return  False if the connection failed.
  */
-int regex_int(std::sregex_iterator ptr) {
-    return std::stoi((*ptr).str());
+bool send_replies(connection& conn) {
+    size_t sent = 0;
+
+    while (sent < conn.pending.size()) {
+        ssize_t count = send(conn.fd, conn.pending.data() + sent,
+                             conn.pending.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (count < 0)
+            return false;
+        sent += count;
+    }
+
+    conn.pending.erase(0, sent);
+    return true;
 }
 
 /**
- *  Obtains a ticket name from a regex pointer.
+ *  Closes the connection and forgets it.
  */
-std::string regex_ticket_name(std::sregex_iterator ptr) {
-    std::string out = (*ptr).str();
-    int format = 0;
+void close_connection(server_state& server, int fd) {
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    server.connections.erase(fd);
+    server.stats.open_connections--;
+}
 
-    if (out[0] == ' ')
-        format += 2;
-    if (out[out.size() - 1] == ' ')
-        format += 1;
+/**
+ *  Waits for the events the connection is ready to handle: requests
+ *  unless too many replies are pending, and room for pending replies.
+ */
+void update_events(server_state& server, connection& conn) {
+    uint32_t events = 0;
+    if (!conn.finished && conn.pending.size() < MAX_PENDING_REPLIES)
+        events |= EPOLLIN;
+    if (!conn.pending.empty())
+        events |= EPOLLOUT;
 
-    return out.substr(format >> 1, out.size() - (format >> 1) - format % 2);
+    if (events != conn.events) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = conn.fd;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+        conn.events = events;
+    }
 }
 
 /**
- *  Converts input to a valid format for the new route function.
- *  And then invokes it with the given input.
+ *  Accepts all the pending clients.
  */
-bool parse_and_run_new_route(routes_data& r_data, const std::string text) {
+void accept_connections(server_state& server) {
+    while (true) {
+        int fd = accept4(server.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR)
+            continue;
+        if (fd < 0)
+            return;
 
-    int route_number;
-    std::vector<int> times;
-    std::vector<std::string> stops;
+        connection& conn = server.connections[fd];
+        conn.fd = fd;
+        conn.events = EPOLLIN;
+
+        epoll_event event = {};
+        event.events = conn.events;
+        event.data.fd = fd;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
 
-    auto nums_begin = std::sregex_iterator(text.begin(), text.end(), NUMBER_REGEX);
-    auto nums_end = std::sregex_iterator();
+        server.stats.connections++;
+        server.stats.open_connections++;
+    }
+}
 
-    route_number = std::stoi((*nums_begin).str());
-    nums_begin++;
+/**
+ *  Handles the events reported for a connection.
+ */
+void handle_connection(server_state& server, int fd, uint32_t events) {
+    auto found = server.connections.find(fd);
+    if (found == server.connections.end())
+        return;
+    connection& conn = found->second;
 
-    int iter = 0;
-    for (std::sregex_iterator i = nums_begin; i != nums_end; ++i) {
-        if (iter % 2 == 0)
-            times.push_back(regex_int(i) * 60);
-        else
-            times[iter / 2]  += regex_int(i);
+    bool ok = true;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        ok = receive_requests(server, conn);
+    if (ok)
+        ok = send_replies(conn);
 
-        iter++;
-    }
+    if (!ok || (conn.finished && conn.pending.empty()))
+        close_connection(server, fd);
+    else
+        update_events(server, conn);
+}
 
-    auto name_begin = std::sregex_iterator(text.begin(), text.end(), STOP_NAME_REGEX);
-    auto name_ends = std::sregex_iterator();
+/**
+ *  Tells whether the Unix socket at 'address' was left by a previous run,
+ *  that is whether it exists but nobody accepts connections on it.
+ */
+bool is_stale_socket(const sockaddr_un& address) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0)
+        return false;
+
+    bool stale = connect(probe, (const sockaddr*)&address, sizeof(address)) < 0 &&
+                 errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
+
+/**
+ *  Closes 'fd' without losing the errno of the call that failed.
+ *
+ * @return  -1, as open_listener reports failures.
+ */
+int abandon_listener(int fd) {
+    int error = errno;
+    if (fd >= 0)
+        close(fd);
+    errno = error;
+    return -1;
+}
 
-    for (std::sregex_iterator i = name_begin; i != name_ends; ++i)
-        stops.push_back((*i).str());
+/**
+ *  Opens the listening socket: a Unix socket at 'socket_path' if it is
+ *  not empty, otherwise a TCP socket on the loopback interface.
+ *
+ * @return  The socket, or -1 if it could not be opened.
+ */
+int open_listener(const std::string& socket_path, int port) {
+    int fd;
 
-    if (times.size() != stops.size())
-        return false; // Wrong stop/time count.
+    if (!socket_path.empty()) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(address.sun_path, socket_path.data(), socket_path.size());
 
-    //Loads data to the container
-    route_info info;
-    info.reserve(stops.size());
-    for (size_t i = 0; i < times.size(); i++)
-        info.push_back(std::make_pair(stops[i], times[i]));
+        // Removes a socket left by a previous run, but no other file
+        // and no socket a running server still listens on.
+        struct stat info;
+        if (stat(socket_path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+            if (!is_stale_socket(address)) {
+                errno = EADDRINUSE;
+                return -1;
+            }
+            unlink(socket_path.c_str());
+        }
 
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) < 0)
+            return abandon_listener(fd);
+    }
+    else {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-    // // Invokes the function
-    // if (!add_new_route(r_data, route_number, info))
-    //     return false;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+            bind(fd, (sockaddr*)&address, sizeof(address)) < 0)
+            return abandon_listener(fd);
+    }
 
-    return add_new_route(route_number, info, r_data.first, r_data.second);
+    if (listen(fd, SOMAXCONN) < 0)
+        return abandon_listener(fd);
+    return fd;
 }
 
 /**
- *  Converts input to a valid format for the new ticket function.
- *  And then invokes the function with the given input.
+ *  Prepares the server to accept clients, with the loaded data as its
+ *  first version. SIGINT and SIGTERM stop the server from then on,
+ *  SIGUSR1 dumps the statistics.
+ *
+ * @return  False if it failed (and errno tells why).
  */
-bool parse_and_run_new_ticket(tickets_data& t_data, const std::string& text) {
+bool open_server(server_state& server, routes_data&& r_data, tickets_data&& t_data) {
+    server.writer.routes = std::make_shared<routes_data>(std::move(r_data));
+    server.writer.tickets = std::make_shared<tickets_data>(std::move(t_data));
+    publish_snapshot(server.writer, server.store);
 
-    auto name_begin = std::sregex_iterator(text.begin(), text.end(), TICKET_NAME);
-    auto num_begin = std::sregex_iterator(text.begin(), text.end(), NUMBER_REGEX);
+    for (output_sink* sink : {&server.outputs.out, &server.outputs.err}) {
+        sink->fd = -1;
+        sink->flush_size = SIZE_MAX;
+    }
 
-    std::string ticket_name = (*name_begin).str();
-    ticket_name = ticket_name.substr(0, ticket_name.size() - 2);
-    int price = regex_int(num_begin) * 100;
-    num_begin++;
-    price += regex_int(num_begin);
-    num_begin++;
-    int expiration_time = regex_int(num_begin);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) < 0)
+        return false;
 
-    //Invokes the function.
-    if (!add_new_ticket(t_data, ticket_name, price, expiration_time))
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server.epoll_fd < 0 || server.signal_fd < 0)
         return false;
 
+    for (int fd : {server.listen_fd, server.signal_fd}) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            return false;
+    }
     return true;
 }
 
 /**
- *  Converts input to a valid format for the best ticket set function.
- *  And then invokes the function with the given input.
+ *  Serves the clients until the server is stopped by a signal.
  */
-bool parse_and_run_plan_tickets(routes_data& r_data, tickets_data& t_data, int& tickets_sold, const std::string& text) {
+void run_server(server_state& server) {
+    epoll_event events[64];
 
-    std::vector<int> routes;
-    std::vector<std::string> stops;
+    while (true) {
+        int count = epoll_wait(server.epoll_fd, events, 64, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return;
 
-    auto nums_begin = std::sregex_iterator(text.begin(), text.end(), NUMBER_REGEX);
-    auto nums_end = std::sregex_iterator();
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
 
-    for (std::sregex_iterator i = nums_begin; i != nums_end; ++i)
-        routes.push_back(regex_int(i));
+            if (fd == server.signal_fd) {
+                signalfd_siginfo info;
+                if (read(server.signal_fd, &info, sizeof(info)) == sizeof(info) &&
+                    info.ssi_signo == SIGUSR1) {
+                    output_sink err;
+                    err.fd = STDERR_FILENO;
+                    write_stats_report(err, server.report_format);
+                    flush_output(err);
+                    continue;
+                }
+                return;
+            }
+            else if (fd == server.listen_fd)
+                accept_connections(server);
+            else
+                handle_connection(server, fd, events[i].events);
+        }
+    }
+}
 
-    auto stop_begin = std::sregex_iterator(text.begin(), text.end(), STOP_NAME_REGEX);
-    auto stop_end = std::sregex_iterator();
+/**
+ *  Closes all connections and sockets of the server.
+ */
+void close_server(server_state& server) {
+    while (!server.connections.empty())
+        close_connection(server, server.connections.begin()->first);
 
-    for (std::sregex_iterator i = stop_begin; i != stop_end; ++i)
-        stops.push_back((*i).str());
+    for (int fd : {server.listen_fd, server.signal_fd, server.epoll_fd})
+        if (fd >= 0)
+            close(fd);
+    // The socket file belongs to this server only if it listened on it.
+    if (server.listen_fd >= 0 && !server.socket_path.empty())
+        unlink(server.socket_path.c_str());
+}
 
-    // Invokes the function.
-    if (!plan_tickets(stops, routes, r_data.second, t_data, tickets_sold))
+/**
+ *  Reads a positive value of the command line option 'name'
+ *  given as "name=value".
+ *
+ * @return  False if the argument is not the option.
+ *          Exits the program if the value is invalid.
+ */
+bool read_option(std::string_view arg, std::string_view name, int& value) {
+    if (arg.substr(0, name.size()) != name || arg.substr(name.size(), 1) != "=")
         return false;
 
+    std::string_view text = arg.substr(name.size() + 1);
+    size_t pos = 0;
+    if (!scan_positive_number(text, pos, value) || pos != text.size()) {
+        std::cerr << "Invalid value of " << name << "\n";
+        exit(1);
+    }
     return true;
 }
 
 /**
- *  Checks whether a line is compatible with the regex.
+ *  Reads a nonempty value of the command line option 'name'
+ *  given as "name=value".
+ *
+ * @return  False if the argument is not the option.
+ *          Exits the program if the value is empty.
  */
-bool check_line(const std::string& text, const std::string& reg) {
-    std::regex word_regex(reg);
-    auto words_begin = std::sregex_iterator(text.begin(), text.end(), word_regex);
-    auto words_end = std::sregex_iterator();
-
-    if (words_begin == words_end)
+bool read_text_option(std::string_view arg, std::string_view name, std::string& value) {
+    if (arg.substr(0, name.size()) != name || arg.substr(name.size(), 1) != "=")
         return false;
 
-    std::smatch match = *words_begin;
-    std::string match_str = match.str();
-
-    if (match_str.size() == text.size())
-        return true;
-    return false;
+    value = arg.substr(name.size() + 1);
+    if (value.empty()) {
+        std::cerr << "Invalid value of " << name << "\n";
+        exit(1);
+    }
+    return true;
 }
 
-/**
- *  Checks if the line is in propper format and
- *  if so invokes a corresponding function.
- */
-void process_line(routes_data& r_data, tickets_data& t_data, int& tickets_sold, std::string& line, int line_num) {
-    bool err = false;
+// Builds that embed kasa.cc (e.g. the benchmarks in bench/)
+// define KASA_NO_MAIN and provide their own entry point.
+#ifndef KASA_NO_MAIN
+int main(int argc, char* argv[]) {
 
-    if (check_line(line, NEW_ROUTE_REGEX))
-        err |= !parse_and_run_new_route(r_data, line);
-    else if (check_line(line, NEW_TICKET_REGEX))
-        err |= !parse_and_run_new_ticket(t_data, line);
-    else if (check_line(line, BEST_TICKET_SET_REGEX))
-        err |= !parse_and_run_plan_tickets(r_data, t_data, tickets_sold, line);
-    else
-        report_error(line, line_num + 1);
+    routes_data r_data;
+    tickets_data t_data;
 
-    if (err)
-        report_error(line, line_num + 1);
-}
+    output_streams outputs;
+    int output_buffer = OUTPUT_BUFFER_SIZE;
+    int threads = 1;
 
-int main() {
+    // The server is started once the standard input is loaded,
+    // if a socket to listen on is given.
+    std::string socket_path;
+    int port = 0;
 
-    std::string line;
-    int line_num = 0;
+    // Snapshot files loaded before and saved after the standard input.
+    std::string load_path;
+    std::string save_path;
 
-    routes_data r_data;
-    tickets_data t_data;
-    int tickets_sold = 0;
+    // Files of routes and of tickets loaded before the main input,
+    // and the file read as the main input instead of the standard input.
+    source_file routes_file;
+    source_file tickets_file;
+    std::string queries_path;
 
-    initialize_optimal_ticket_set(t_data);
+    // Statistics dumped to the standard error at exit.
+    std::string stats_name;
+    stats_format report_format = STATS_NONE;
 
-    while (!std::cin.eof()) {
-        line = "";
+    // Whether the memory report is written to the standard error at exit.
+    bool memory_report_at_exit = false;
 
-        std::getline(std::cin, line);
+    // Bounds not fixed at compile time default to the task ones.
+    int max_tickets = KASA_MAX_TICKETS != DYNAMIC_BOUND ? KASA_MAX_TICKETS : 3;
+    int max_length = KASA_MAX_TRIP_LENGTH != DYNAMIC_BOUND ? KASA_MAX_TRIP_LENGTH : MAX_TRIP_LENGTH;
 
-        if (line.size() != 0)
-            process_line(r_data, t_data, tickets_sold, line, line_num);
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
 
-        line_num++;
+        if (KASA_MAX_TICKETS == DYNAMIC_BOUND && read_option(arg, "--max-tickets", max_tickets))
+            continue;
+        if (KASA_MAX_TRIP_LENGTH == DYNAMIC_BOUND && read_option(arg, "--max-trip-length", max_length))
+            continue;
+        if (read_option(arg, "--output-buffer", output_buffer))
+            continue;
+        if (read_option(arg, "--threads", threads))
+            continue;
+        if (read_text_option(arg, "--socket", socket_path))
+            continue;
+        if (read_text_option(arg, "--load-snapshot", load_path))
+            continue;
+        if (read_text_option(arg, "--save-snapshot", save_path))
+            continue;
+        if (read_text_option(arg, "--routes", routes_file.path))
+            continue;
+        if (read_text_option(arg, "--tickets", tickets_file.path))
+            continue;
+        if (read_text_option(arg, "--queries", queries_path))
+            continue;
+        if (arg == "--memory") {
+            memory_report_at_exit = true;
+            continue;
+        }
+        if (read_text_option(arg, "--stats", stats_name)) {
+            report_format = stats_name == "json" ? STATS_JSON
+                          : stats_name == "prometheus" ? STATS_PROMETHEUS : STATS_NONE;
+            if (report_format == STATS_NONE || !KASA_STATS) {
+                std::cerr << (KASA_STATS ? "Invalid value of --stats\n"
+                                         : "Statistics are not compiled in (KASA_STATS)\n");
+                return 1;
+            }
+            continue;
+        }
+        if (read_option(arg, "--port", port)) {
+            if (port > 65535) {
+                std::cerr << "Invalid value of --port\n";
+                return 1;
+            }
+            continue;
+        }
+
+        std::cerr << "Unknown option " << arg << "\n";
+        return 1;
+    }
+
+    initialize_optimal_ticket_set(t_data, max_tickets, max_length);
+    open_outputs(outputs, output_buffer);
+
+    std::string error;
+    if (!load_path.empty() && !load_snapshot_file(load_path, r_data, t_data, error)) {
+        std::cerr << "Cannot load the snapshot " << load_path << ": " << error << "\n";
+        return 1;
+    }
+
+    if (!load_source_files(routes_file, tickets_file, r_data, t_data, outputs, threads)) {
+        source_file& failed = routes_file.error != 0 ? routes_file : tickets_file;
+        flush_output(outputs.err);
+        std::cerr << "Cannot read " << failed.path << ": " << strerror(failed.error) << "\n";
+        return 1;
+    }
+
+    int input_fd = STDIN_FILENO;
+    if (!queries_path.empty() && (input_fd = open(queries_path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        std::cerr << "Cannot read " << queries_path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    input_reader input;
+    open_input(input, input_fd);
+
+    // The temporaries of the processing are counted before they are freed.
+    memory_report report;
+    memory_report* input_report = memory_report_at_exit && socket_path.empty() && port == 0
+        ? &report : nullptr;
+    int tickets_sold = threads > 1
+        ? process_input_parallel(input, r_data, t_data, outputs, threads, input_report)
+        : process_input(input, r_data, t_data, outputs, input_report);
+    close_input(input);
+    if (input_fd != STDIN_FILENO)
+        close(input_fd);
+
+    if (!save_path.empty() && !save_snapshot_file(save_path, r_data, t_data)) {
+        flush_output(outputs.out);
+        flush_output(outputs.err);
+        std::cerr << "Cannot save the snapshot " << save_path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    if (!socket_path.empty() || port > 0) {
+        // The server has buffers of its own.
+        for (output_sink* sink : {&outputs.out, &outputs.err}) {
+            flush_output(*sink);
+            std::string().swap(sink->buffer);
+        }
+
+        server_state server;
+        server.socket_path = socket_path;
+        server.report_format = report_format;
+        server.listen_fd = open_listener(socket_path, port);
+        server.stats.tickets_sold = tickets_sold;
+
+        if (server.listen_fd < 0 ||
+            !open_server(server, std::move(r_data), std::move(t_data))) {
+            std::cerr << "Cannot start the server: " << strerror(errno) << "\n";
+            close_server(server);
+            return 1;
+        }
+
+        run_server(server);
+        if (memory_report_at_exit) {
+            write_server_memory(outputs.err, server);
+            flush_output(outputs.err);
+        }
+        close_server(server);
+        tickets_sold = server.stats.tickets_sold;
+    }
+
+    write_output(outputs.out, tickets_sold);
+    write_output(outputs.out, "\n");
+    flush_output(outputs.out);
+
+    if (report_format != STATS_NONE) {
+        write_stats_report(outputs.err, report_format);
+        flush_output(outputs.err);
     }
 
-    std::cout << tickets_sold << "\n";
+    // The data of a server was reported before it was closed.
+    if (input_report != nullptr) {
+        count_routes_memory(report, r_data);
+        count_tickets_memory(report, t_data);
+        count_outputs_memory(report, outputs);
+        write_memory_report(outputs.err, report);
+        flush_output(outputs.err);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
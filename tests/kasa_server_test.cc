@@ -0,0 +1,346 @@
+// Scripted test of the server protocol: runs a server on a Unix socket in
+// a child process, talks to it through the text protocol and binary frames
+// and compares the replies byte for byte.
+//
+// Build and run (from the repository root):
+//   g++ -std=c++17 -O2 -pthread tests/kasa_server_test.cc -o kasa_server_test
+//   ./kasa_server_test
+//
+// Every failed check is written to the standard error; the exit code
+// is 0 only if all of them passed.
+
+#define KASA_NO_MAIN
+#include "../kasa.cc"
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <thread>
+
+// Number of failed checks.
+int failures = 0;
+
+/**
+ *  Makes 'text' readable in a failure message: bytes outside printable
+ *  ASCII are written as \xNN.
+ */
+std::string escape(std::string_view text) {
+    std::string escaped;
+    for (unsigned char c : text) {
+        if (c >= ' ' && c < 0x7F && c != '\\') {
+            escaped += c;
+        }
+        else {
+            char code[8];
+            snprintf(code, sizeof(code), "\\x%02X", c);
+            escaped += code;
+        }
+    }
+    return escaped;
+}
+
+/**
+ *  Counts a failure unless 'actual' is 'expected'.
+ */
+void check_equal(std::string_view name, std::string_view actual, std::string_view expected) {
+    if (actual == expected)
+        return;
+    failures++;
+    std::cerr << "FAILED " << name << "\n"
+              << "  expected: " << escape(expected) << "\n"
+              << "  actual:   " << escape(actual) << "\n";
+}
+
+/**
+ *  Counts a failure unless 'condition' holds.
+ */
+void check(std::string_view name, bool condition) {
+    if (condition)
+        return;
+    failures++;
+    std::cerr << "FAILED " << name << "\n";
+}
+
+/**
+ *  Returns the frame of the given kind and payload, built by hand
+ *  rather than by 'append_frame' so that the check of it is independent.
+ */
+std::string make_frame(unsigned char kind, std::string_view payload) {
+    std::string frame = {(char)0xB5, (char)kind};
+    uint32_t length = payload.size();
+    for (int i = 0; i < 4; i++)
+        frame += (char)(length >> (8 * i));
+    frame.append(payload);
+    return frame;
+}
+
+/**
+ *  Splits the first frame off 'text'.
+ *
+ * @return  False if 'text' does not start with a complete frame.
+ */
+bool take_frame(std::string_view& text, unsigned char& kind, std::string_view& payload) {
+    if (text.size() < FRAME_HEADER_SIZE || (unsigned char)text[0] != FRAME_MAGIC)
+        return false;
+
+    uint32_t length = 0;
+    for (int i = 0; i < 4; i++)
+        length |= (uint32_t)(unsigned char)text[2 + i] << (8 * i);
+    if (text.size() - FRAME_HEADER_SIZE < length)
+        return false;
+
+    kind = text[1];
+    payload = text.substr(FRAME_HEADER_SIZE, length);
+    text.remove_prefix(FRAME_HEADER_SIZE + length);
+    return true;
+}
+
+/**
+ *  Checks the encoding of frames without a server.
+ */
+void check_frame_encoding() {
+    std::string text;
+    append_frame(text, FRAME_LINE, "? Sa 1 Sb");
+    check_equal("frame of a line", text, make_frame(1, "? Sa 1 Sb"));
+
+    text.clear();
+    append_frame(text, FRAME_STATS, "");
+    check_equal("empty frame", text, std::string("\xB5\x02\0\0\0\0", 6));
+
+    // The length takes more than one byte.
+    text.clear();
+    std::string payload(0x10203, 'x');
+    append_frame(text, FRAME_LINE, payload);
+    check_equal("length of a long frame", text.substr(0, FRAME_HEADER_SIZE),
+                std::string("\xB5\x01\x03\x02\x01\x00", 6));
+
+    std::string_view rest = text;
+    unsigned char kind = 0;
+    std::string_view decoded;
+    check("decoding of a long frame", take_frame(rest, kind, decoded) &&
+          kind == FRAME_LINE && decoded == payload && rest.empty());
+
+    rest = std::string_view(text).substr(0, text.size() - 1);
+    check("decoding of a truncated frame", !take_frame(rest, kind, decoded));
+}
+
+/**
+ *  Runs a server listening on 'socket_path' in a child process,
+ *  with no routes and tickets and the default bounds.
+ *
+ * @return  The process of the server.
+ */
+pid_t start_server(const std::string& socket_path) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    routes_data r_data;
+    tickets_data t_data;
+    initialize_optimal_ticket_set(t_data, KASA_MAX_TICKETS != DYNAMIC_BOUND ? KASA_MAX_TICKETS : 3,
+                                  KASA_MAX_TRIP_LENGTH != DYNAMIC_BOUND ? KASA_MAX_TRIP_LENGTH
+                                                                        : MAX_TRIP_LENGTH);
+
+    server_state server;
+    server.socket_path = socket_path;
+    server.listen_fd = open_listener(socket_path, 0);
+    if (server.listen_fd < 0 || !open_server(server, std::move(r_data), std::move(t_data)))
+        _exit(1);
+
+    run_server(server);
+    close_server(server);
+    _exit(0);
+}
+
+/**
+ *  Connects to the server, waiting for it to listen.
+ *
+ * @return  The socket, or -1 if the server did not start listening.
+ */
+int connect_server(const std::string& socket_path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, socket_path.data(), socket_path.size());
+
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (const sockaddr*)&address, sizeof(address)) == 0)
+            return fd;
+        if (fd >= 0)
+            close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+/**
+ *  Sends the requests to the server over a new connection, ends them
+ *  and returns everything the server replied until it closed the connection.
+ */
+std::string talk_to_server(const std::string& socket_path, std::string_view requests) {
+    int fd = connect_server(socket_path);
+    if (fd < 0) {
+        check("connection to the server", false);
+        return "";
+    }
+
+    size_t sent = 0;
+    while (sent < requests.size()) {
+        ssize_t count = send(fd, requests.data() + sent, requests.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            break;
+        sent += count;
+    }
+    shutdown(fd, SHUT_WR);
+
+    std::string replies;
+    char block[1 << 16];
+    while (true) {
+        ssize_t count = read(fd, block, sizeof(block));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        replies.append(block, count);
+    }
+    close(fd);
+    return replies;
+}
+
+/**
+ *  Tells whether every line of the text is a "memory_<name> <number>" line.
+ */
+bool is_memory_report(std::string_view text) {
+    if (text.empty() || text.back() != '\n')
+        return false;
+
+    for (size_t pos = 0; pos < text.size();) {
+        size_t end = text.find('\n', pos);
+        std::string_view line = text.substr(pos, end - pos);
+        size_t space = line.find(' ');
+        if (line.substr(0, 7) != "memory_" || space == std::string_view::npos ||
+            space + 1 == line.size() ||
+            line.find_first_not_of("0123456789", space + 1) != std::string_view::npos)
+            return false;
+        pos = end + 1;
+    }
+    return true;
+}
+
+/**
+ *  Checks the text protocol: lines of the grammar, their errors
+ *  numbered within the connection, the statistics, and a last line
+ *  without its newline.
+ */
+void check_text_protocol(const std::string& socket_path) {
+    std::string replies = talk_to_server(socket_path,
+        "1 6:00 Sa 6:05 Sb\n"
+        "Ta 5.00 10\n"
+        "? Sa 1 Sb\n"
+        "bad\n"
+        "#stats\n"
+        "?@ Sa 6:00 Sb");
+
+    check_equal("text protocol", replies,
+        "! Ta\n"
+        "Error in line 4:bad\n"
+        "tickets_sold 1\n"
+        "requests 5\n"
+        "connections 1\n"
+        "open_connections 1\n"
+        "! Ta\n");
+}
+
+/**
+ *  Checks the binary frames, mixed with text lines on the same
+ *  connection: every frame gets a reply frame of the same kind,
+ *  empty if the line has no output.
+ */
+void check_frame_protocol(const std::string& socket_path) {
+    std::string replies = talk_to_server(socket_path,
+        make_frame(FRAME_LINE, "Tb 1.00 3") +
+        make_frame(FRAME_LINE, "? Sa 1 Sb") +
+        make_frame(FRAME_LINE, "? Sa") +
+        "#stats\n" +
+        make_frame(FRAME_STATS, "") +
+        make_frame(FRAME_LINE, "#memory"));
+
+    const char* stats =
+        "tickets_sold 4\n"
+        "requests 10\n"
+        "connections 2\n"
+        "open_connections 1\n";
+
+    std::string_view rest = replies;
+    unsigned char kind = 0;
+    std::string_view payload;
+
+    check("frame of a ticket", take_frame(rest, kind, payload) && kind == FRAME_LINE);
+    check_equal("reply to a ticket", payload, "");
+
+    check("frame of a trip", take_frame(rest, kind, payload) && kind == FRAME_LINE);
+    check_equal("reply to a trip", payload, "! Tb; Tb\n");
+
+    check("frame of an error", take_frame(rest, kind, payload) && kind == FRAME_LINE);
+    check_equal("reply to an error", payload, "Error in line 3:? Sa\n");
+
+    check_equal("text statistics", rest.substr(0, strlen(stats)), stats);
+    rest.remove_prefix(std::min(rest.size(), strlen(stats)));
+
+    check("frame of statistics", take_frame(rest, kind, payload) && kind == FRAME_STATS);
+    check_equal("reply to statistics", payload, stats);
+
+    check("frame of a memory report", take_frame(rest, kind, payload) && kind == FRAME_LINE);
+    check("reply to a memory report", is_memory_report(payload) &&
+          payload.find("\nmemory_total_bytes ") != std::string_view::npos);
+
+    check_equal("end of the replies", rest, "");
+}
+
+/**
+ *  Checks that a client breaking the protocol is disconnected
+ *  without a reply, and that the server keeps serving others.
+ */
+void check_protocol_errors(const std::string& socket_path) {
+    check_equal("line frame with a newline",
+                talk_to_server(socket_path, make_frame(FRAME_LINE, "? Sa 1 Sb\n? Sa 1 Sb")), "");
+    check_equal("frame of unknown kind", talk_to_server(socket_path, make_frame(7, "")), "");
+    check_equal("statistics frame with a payload",
+                talk_to_server(socket_path, make_frame(FRAME_STATS, "x")), "");
+    check_equal("too long frame",
+                talk_to_server(socket_path, std::string("\xB5\x01\xFF\xFF\xFF\x7F", 6)), "");
+
+    check_equal("serving after errors", talk_to_server(socket_path, "? Sa 1 Sb\n"), "! Tb; Tb\n");
+}
+
+int main() {
+    check_frame_encoding();
+
+    std::string socket_path = "/tmp/kasa_server_test." + std::to_string(getpid()) + ".sock";
+    pid_t server = start_server(socket_path);
+    if (server < 0) {
+        std::cerr << "Cannot start the server: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    check_text_protocol(socket_path);
+    check_frame_protocol(socket_path);
+    check_protocol_errors(socket_path);
+
+    int status = 0;
+    kill(server, SIGTERM);
+    waitpid(server, &status, 0);
+    check("server stopped by SIGTERM", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    struct stat info;
+    check("socket removed by the server", stat(socket_path.c_str(), &info) < 0 && errno == ENOENT);
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "all checks passed\n";
+    return 0;
+}